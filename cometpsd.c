@@ -25,6 +25,9 @@ THE SOFTWARE.
 */
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
 
 #include <sys/queue.h>
 #include <sys/tree.h>
@@ -35,26 +38,82 @@ THE SOFTWARE.
 #include <string.h>
 #include <assert.h>
 #include <err.h>
+#include <strings.h>
+#include <ctype.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 
 #include <event.h>
 #include <evhttp.h>
+#include <zlib.h>
 
 #include "yconf.h"
+#include "sha1.h"
+#include "twheel.h"
+#include "slab.h"
+#include "logring.h"
+#include "msglog.h"
+#include "_4ksp.h"
 
 #define CPS_LOG_ERR 0
 #define CPS_LOG_WARN 1
 #define CPS_LOG_INFO 2
 #define CPS_LOG_DEBUG 3
 
+// Messages above this level are compiled out, arguments and all
+#ifndef CPS_LOG_MAX
+#define CPS_LOG_MAX CPS_LOG_DEBUG
+#endif
+
 #define MAX_CLIENT_BUFSIZ	(1000 * 1000)
+#define MAX_JSONP_CALLBACK	128
+#define MAX_WORKERS	256
+#define DEFAULT_JSONP_CALLBACK "jsonpcallback"
+#define DEFAULT_HISTORY	32
+#define DEFAULT_POLL_TIMEOUT	30
+#define TIMER_TICK_MS	100
+#define SLAB_CHUNK_OBJECTS	128
+#define BODY_SLAB_SIZE	512   // bodies up to this size (struct included) come from a slab
+#define QUERY_SCRATCH_SIZE	1024
+#define MAX_QUERY_PARAMS	16
+#define STATS_INTERVAL	60    // seconds between pool statistics in the debug log
+#define DEFAULT_CHANNELS_URI	"/channel/"
+#define DEFAULT_IDLE_TIMEOUT	60    // seconds before an unused dynamic channel is reclaimed
+#define MAX_CHANNEL_NAME	200
+#define FORMAT_HEAD_MAX	(MAX_JSONP_CALLBACK + MAX_CHANNEL_NAME + 32)  // framing written before a message
+#define FORMAT_TAIL_MAX	(MAX_CHANNEL_NAME + 64)  // and after it
+#define MIN_CHANNEL_BUCKETS	64
+#define DEFAULT_PUBLISH_URI	"/publish"
+#define DEFAULT_RETRY_AFTER	5     // seconds, suggested to subscribers turned away with 503
+#define MAX_SELECTOR	2048  // channel names and patterns of a multi-channel subscription
+#define DEFAULT_COMPRESS_MIN_SIZE	256
+#define FANOUT_SLICE	1024  // subscribers sent to before other events get a turn
+#define MAX_BATCH	64    // messages in one batched long-poll response
+#define MAX_BATCH_LINGER	1000  // ms a batching subscriber may wait for more messages
+#define MAX_REPLAY	10000 // messages a resuming subscriber is sent from a channel's log at once
+#define DEFAULT_DATA_DIR	"data"
+#define DEFAULT_SEGMENT_SIZE	(8 * 1024 * 1024)
+#define DEFAULT_STATS_URI	"/_stats"
+#define DEFAULT_DRAIN_TIMEOUT	10    // seconds over which an upgraded process hands over its subscribers
+#define UPGRADE_FD_ENV	"CPS_UPGRADE_FD"
+#define UPGRADE_SEQ_RESERVE	1000000 // sequence numbers left to a process until the one upgrading it is ready
+#define FANOUT_BUCKETS	12    // of the fan-out duration histogram, not counting the last
+#define WORKER_POOLS	5
+#define DEFAULT_LOG_BUFFER	4096  // lines waiting to be written to stderr
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
 #define cps_warn(fmt, ...) \
 	warn("%s:%d (%s) " fmt, __FILE__, __LINE__, __FUNCTION__, ##__VA_ARGS__)
 
+// Lines are handed to the log ring and written to stderr by a background
+// thread, so the event loops never wait for whoever reads the log.
 #define cps_log(CL, L, fmt, ...)\
-	do { if ((CL) >= (L))\
-		fprintf(stderr,\
+	do { if ((L) <= CPS_LOG_MAX && (CL) >= (L))\
+		logring_printf(\
 		"%s " fmt "\n", (L>CPS_LOG_INFO ?"D":(L>CPS_LOG_WARN ?"I":(L>CPS_LOG_ERR ?"W":"E"))), ##__VA_ARGS__);\
 	} while(0)
 
@@ -89,273 +148,4522 @@ THE SOFTWARE.
 // fwd decl
 struct cps_channel;
 struct cps_server;
+struct cps_worker;
+
+// A request body shared by the messages of a batch publish, which point into
+// it instead of each carrying a copy of their payload.
+struct cps_blob {
+	int refcount;
+	size_t length;
+	char data[];
+};
+
+// A published message, handed to every worker by the sequencer of its server.
+// The channel name, sender and payload are stored inline after the struct,
+// unless the payload lies in a shared <blob>. Messages are shared between
+// workers and kept in channel histories, so the reference count is updated
+// atomically.
+struct cps_msg {
+	struct cps_msg *next; // in the sequencer's ingress
+	int refcount;
+	int server_id;
+	uint64_t seq;
+	const char *channel;
+	const char *sender;
+	const char *key;               // conflation key, NULL for none
+	const char *data;
+	size_t length;
+	struct cps_blob *blob;
+};
+
+// A rendered response body -- "callback(" payload ", " seq ");" in the framing
+// of its format -- shared by every subscriber using the same format and JSONP
+// callback. Subscribers reference the bytes through evbuffer reference chains
+// and the body is freed when the last chain referencing it has been written.
+struct cps_body {
+	slab_t *slab;     // NULL if allocated with malloc
+	int format;
+	int encoding;     // Content-Encoding of <data>
+	char *jsonp;
+	char *data;
+	size_t length;
+	int refcount;
+	RB_ENTRY(cps_body) entry;
+};
+RB_HEAD(cps_bodies, cps_body);
+
+enum cps_format {
+	CPS_FORMAT_JSONP = 0,
+	CPS_FORMAT_SCRIPT,    // <script> tags for a streaming (forever-frame) response
+	CPS_FORMAT_SSE,       // Server-Sent Events (text/event-stream)
+	CPS_FORMAT_WS,        // WebSocket text frames
+};
+
+static const char *cps_format_open[] = { "", "<script>", "", "" };
+static const char *cps_format_close[] = { "", "</script>\n", "", "" };
+static const char *cps_format_content_type[] = {
+	"text/javascript; charset=utf-8",
+	"text/html; charset=utf-8",
+	"text/event-stream; charset=utf-8",
+	NULL,
+};
+
+// Content-Encodings a long-polling subscriber may get its response in. Bodies
+// are compressed once per publish for all subscribers accepting an encoding.
+enum cps_encoding {
+	CPS_ENCODING_IDENTITY = 0,
+	CPS_ENCODING_GZIP,
+	CPS_ENCODING_DEFLATE,
+	CPS_ENCODINGS
+};
+
+static const char *cps_encoding_names[] = { "identity", "gzip", "deflate" };
+
+// What a channel does with a streaming subscriber whose backlog would grow
+// beyond the channel's max_buffer.
+enum cps_overflow {
+	CPS_OVERFLOW_DISCONNECT = 0,  // close the connection; the client resumes from history
+	CPS_OVERFLOW_DROP_OLDEST,     // drop queued messages, oldest first, until the new one fits
+	CPS_OVERFLOW_COALESCE,        // drop every queued message in favour of the new one
+};
 
+static const char *cps_overflow_names[] = { "disconnect", "drop_oldest", "coalesce" };
+
+// Looks up the overflow policy called <name>, leaving <overflow> as it is
+// if there is none.
+static int cps_overflow_parse(const char *name, enum cps_overflow *overflow) {
+	int i;
+	for (i = 0; i < sizeof(cps_overflow_names) / sizeof(cps_overflow_names[0]); i++) {
+		if (strcmp(name, cps_overflow_names[i]) == 0) {
+			*overflow = (enum cps_overflow)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// A body waiting for a slow subscriber's connection to drain, or a message
+// held for a batching long-poll subscriber.
+struct cps_qent {
+	struct cps_body *body;
+	struct cps_msg *msg;
+	TAILQ_ENTRY(cps_qent) next;
+};
+TAILQ_HEAD(cps_queue, cps_qent);
+
+// Subscriber options are parsed from the request URI once, at subscribe time,
+// so delivering a message does not need to look at the query string.
 struct cps_sub {
 	struct evhttp_request	*req;
-	struct event		      ev;
+	struct event		      ev;           // detects the client closing the connection
+	twheel_timer_t        timer;        // long-poll timeout
 	struct cps_channel    *channel;
+	enum cps_format       format;
+	bool                  stream;
+	char                  jsonp[MAX_JSONP_CALLBACK];
+	bool                  has_since;
+	uint64_t              since;
+	enum cps_encoding     encoding;     // of long-poll responses, from Accept-Encoding
+	struct bufferevent    *ws;          // set once upgraded to a WebSocket
+	struct evbuffer       *ws_frag;     // payload of a fragmented message
+	bool                  ws_publisher; // may publish by sending frames
+	bool                  ws_closing;
+	struct cps_queue      queue;        // bodies waiting for the connection to drain
+	size_t                queued;       // bytes in <queue>, or messages when batching
+	bool                  batch;        // answer long-polls with all messages at once
+	int                   linger;       // ms to wait for more once the first arrived
+	struct event          batch_ev;
+	unsigned long         mark;         // channel->published when subscribed
 	TAILQ_ENTRY(cps_sub)	next;
 };
 TAILQ_HEAD(cps_subs, cps_sub);
 
+// Ring of the most recent messages published to a channel, oldest at <head>.
+struct cps_history {
+	struct cps_msg **msgs;
+	int size;
+	int count;
+	int head;
+};
+
+// The newest message for one key of a conflating channel, waiting for the end
+// of the window. Messages without a key all share the same entry.
+struct cps_latest {
+	struct cps_msg *msg;
+	RB_ENTRY(cps_latest) entry;
+	TAILQ_ENTRY(cps_latest) next;
+};
+RB_HEAD(cps_latest_keys, cps_latest);
+TAILQ_HEAD(cps_latest_list, cps_latest);
+
+// A message on its way to the subscribers of a channel. Channels with many
+// subscribers are sent to in slices of FANOUT_SLICE, so that other events
+// (and smaller channels) are not held up by a large broadcast.
+struct cps_fanout {
+	struct cps_msg *msg;
+	unsigned long mark;            // subscribers with a mark at least this came later
+	struct cps_bodies bodies;      // each distinct body, rendered once and shared by the subscribers
+	int count;                     // subscribers sent to so far
+	uint64_t start;                // µs, when it was published on this worker
+	TAILQ_ENTRY(cps_fanout) next;
+};
+TAILQ_HEAD(cps_fanouts, cps_fanout);
+
+// Ties a selector channel to one of its channel names or patterns, in the
+// list of the trie node the name or pattern ends at.
+struct cps_chlink {
+	struct cps_channel *channel;
+	struct cps_trie_node *node;
+	bool rest;                     // in node->rest rather than node->exact
+	TAILQ_ENTRY(cps_chlink) next;
+};
+TAILQ_HEAD(cps_chlinks, cps_chlink);
+
+// Trie over the dot-separated segments of channel names, indexing selector
+// channels by the names and patterns they listen to. A "*" segment matches
+// any one segment, and a trailing ".*" any number (at least one) of them.
+// Matching a channel name walks at most two branches per segment, however
+// many patterns there are.
+struct cps_trie_node {
+	char *segment;
+	size_t seglen;
+	struct cps_trie_node *parent;
+	RB_HEAD(cps_trie, cps_trie_node) children;
+	RB_ENTRY(cps_trie_node) entry;
+	struct cps_chlinks exact;      // names and patterns ending at this node
+	struct cps_chlinks rest;       // patterns ending at this node with ".*"
+};
+
+// Upper bounds, in microseconds, of the buckets of the fan-out duration
+// histogram. Slower fan-outs are counted in a last bucket.
+static const unsigned long cps_fanout_buckets[FANOUT_BUCKETS] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 250000, 1000000
+};
+
+// Counters of a channel replica. Each worker only touches those of its own
+// replicas, so they are plain increments; /_stats adds up the replicas of all
+// workers.
+struct cps_stats {
+	unsigned long subscribers;     // connected (filled in when gathered)
+	unsigned long subscribes;      // subscribe requests, including every long-poll reconnect
+	unsigned long rejected;        // subscribers turned away by max_clients
+	unsigned long publishes;       // messages published to the channel
+	unsigned long bytes_in;        // their payload
+	unsigned long sent;            // messages sent to the subscribers, after conflation
+	unsigned long conflated;       // messages replaced by newer ones before being sent
+	unsigned long deliveries;      // messages handed to subscribers
+	unsigned long bytes_out;       // bytes handed to subscriber connections
+	unsigned long evicted;         // slow subscribers disconnected
+	unsigned long dropped;         // messages dropped for slow subscribers
+	unsigned long coalesced;       // messages replaced by newer ones for slow subscribers
+	unsigned long fanouts;         // messages sent to every subscriber
+	unsigned long fanout_usec;     // how long that took, in total
+	unsigned long fanout_hist[FANOUT_BUCKETS + 1];
+};
+
 struct cps_channel {
 	char *name;
 	char *uri;
 	char *pubkey;
 	int log_level;
+	bool dynamic;                  // created on first use, reclaimed when idle
+	bool selector;                 // listens to other channels, through <links>
+	struct cps_chlink *links;
+	int nlinks;
+	uint64_t last_seq;             // last message a selector channel got
+	twheel_timer_t idle_timer;     // armed while a dynamic channel has no subscribers
 	struct cps_server *server;
 	struct cps_subs subs;
+	int nsubs;                     // subscribers on this worker
+	int *clients;                  // subscribers on all workers, shared by the replicas
+	bool own_clients;
+	int max_clients;               // 0 for no limit
+	size_t max_buffer;             // bytes a streaming subscriber may fall behind
+	enum cps_overflow overflow;
+	int conflate;                  // ms; sends at most the latest message per key this often
+	bool conflating;               // a window is open
+	struct event conflate_ev;      // ends it
+	struct cps_latest_keys latest; // held back until then
+	struct cps_latest_list latest_order;
+	struct cps_history history;
+	msglog_t *log;                 // messages kept on disk, shared by the replicas; NULL for none
+	bool own_log;                  // written to, flushed and closed by this replica
+	TAILQ_ENTRY(cps_channel) log_next;
+	unsigned long published;       // messages added to <history> on this worker
+	struct cps_fanouts fanouts;    // messages still being sent, oldest first
+	struct cps_sub *cursor;        // next subscriber for the oldest of <fanouts>
+	struct cps_stats stats;
+	bool busy;                     // in the worker's list of channels with fanouts
+	TAILQ_ENTRY(cps_channel) busy_next;
+	struct cps_channel *hnext;     // next in the server's hash bucket
 	TAILQ_ENTRY(cps_channel) next;
 };
 TAILQ_HEAD(cps_channels, cps_channel);
 
+// Key/value pairs of a request's query string, split and decoded in place.
+// Subscribers only look at the query while subscribing, so the pairs live
+// in pooled scratch space which is recycled right after.
+struct cps_query {
+	char *buf;        // <data>, or malloc'ed if the query does not fit
+	int count;
+	struct {
+		const char *key;
+		const char *value;
+	} params[MAX_QUERY_PARAMS];
+	char data[QUERY_SCRATCH_SIZE];
+};
+
+// Settings of the channels a server creates when first requested.
+struct cps_dynamic {
+	bool enabled;
+	int history;
+	char *pubkey;
+	int log_level;
+	int idle_timeout;     // seconds
+	size_t max_channels;  // 0 for no limit
+	size_t max_buffer;
+	enum cps_overflow overflow;
+	int conflate;
+};
+
+// Each worker runs one replica of every configured server. Replicas of the
+// same server share an id, which is how a message published on one worker
+// finds the matching server on the others.
 struct cps_server {
+	int id;
+	struct cps_sequencer *sequencer; // shared by all replicas
 	struct evhttp *http;
+	struct cps_worker *worker;
 	struct cps_channels channels;
+	struct cps_channels logged;   // channels whose log this replica writes
+	struct cps_channel **buckets; // channels by name, chained through hnext
+	struct cps_trie_node *trie;   // selector channels by what they listen to
+	size_t nbuckets;              // a power of two
+	size_t nchannels;
 	char *name;
-	char *channels_uri;
+	char *channels_uri;     // prefix routed to channels, followed by the name
+	char *publish_uri;      // batch publishing
+	char *stats_uri;        // counters of the server and its channels
+	char *pubkey;           // grants batch publishing to every channel
 	char *docroot;
 	int log_level;
+	int poll_timeout;       // seconds, 0 to wait forever
+	int *connections;       // subscribers on all workers, shared by all replicas
+	int max_connections;    // 0 for no limit
+	int retry_after;        // seconds
+	int drain_timeout;      // seconds
+	size_t compress_min_size; // smallest body worth compressing; 0 to never compress
+	unsigned long rejected; // subscribers turned away by max_connections
+	twheel_t wheel;         // long-poll timeouts, in ticks of TIMER_TICK_MS
+	twheel_t idle_wheel;    // idle dynamic channels
+	struct event tick_ev;
+	struct evhttp_bound_socket *bound; // the listening socket, until handed over by an upgrade
+	uint64_t drain_until;   // tick by which an upgrade has closed every subscriber, 0 if none
+	// channels created when first requested; disabled while dynamic.enabled is false
+	struct cps_dynamic dynamic;
 	TAILQ_ENTRY(cps_server) next;
 };
 TAILQ_HEAD(cps_servers, cps_server);
 
+// Delivers a cps_msg to a worker's inbox. A message is shared by all workers,
+// so each of them gets its own envelope. An envelope without a message asks
+// the worker to make a call instead.
+struct cps_envelope {
+	struct cps_envelope *next;
+	struct cps_msg *msg;
+	void (*call)(struct cps_worker *worker, void *arg);
+	void *arg;
+	bool keep;                 // part of <arg> and pushed again later, so not freed once called
+};
+
+// Puts the messages published to a server, on any of the workers, in one
+// order and numbers them. Publishers push onto the lock-free <ingress>, and
+// the one which finds it empty pushes <drain> onto the first worker's inbox.
+// The first worker then takes everything off the ingress, numbers it and
+// hands it to every worker, itself included. Being the only thread which
+// hands out the server's messages, it gives every worker the same order,
+// without a lock on the way.
+struct cps_sequencer {
+	struct cps_msg *ingress;   // newest first
+	struct cps_envelope drain;
+	uint64_t last;             // the number given out last, by the first worker
+	uint64_t floor;            // numbers up to this one were given out by the process upgraded, or logged
+	uint64_t limit;            // while upgrading, where the new process starts numbering; 0 if none
+};
+
+// An event loop thread. Other threads (and the thread itself) hand it
+// envelopes by pushing onto the lock-free inbox and, when the inbox was empty,
+// writing a byte to notify_fds.
+struct cps_worker {
+	int id;
+	pthread_t thread;
+	struct event_base *base;
+	struct evbuffer *scratch; // reusable buffer for sending chunks
+	slab_t subs;              // cps_sub
+	slab_t bodies;            // cps_body of at most BODY_SLAB_SIZE bytes
+	slab_t queries;           // cps_query
+	slab_t qents;             // cps_qent
+	slab_t fanouts;           // cps_fanout
+	z_stream *deflate[CPS_ENCODINGS]; // reused for every compressed body
+	struct cps_envelope *inbox;
+	struct cps_envelope stop; // pushed by cps_workers_stop, so stopping allocates nothing
+	int notify_fds[2];
+	struct event notify_ev;
+	struct cps_channels busy; // channels with fanouts left, taking turns
+	struct event fanout_ev;
+	struct cps_servers servers;
+};
+
+// A channel as configured (or as a server's dynamic channels are). Strings
+// belong to the configuration.
+struct cps_channel_conf {
+	char *name;
+	int max_clients;
+	int history;
+	char *pubkey;
+	int log_level;
+	size_t max_buffer;
+	enum cps_overflow overflow;
+	int conflate;
+	char *persist_dir;         // directory of its message log, NULL to keep none
+	size_t segment_size;
+	size_t persist_max_bytes;  // retention; 0 for no limit
+	int persist_max_age;       // seconds; 0 for no limit
+	int *clients;              // subscriber count shared by the replicas, once one is open
+	msglog_t *log;             // likewise, the message log
+};
+
+// A server as configured. Servers are told apart by their <name>
+// (address:port), which is how a reload matches them up with the running ones.
+struct cps_server_conf {
+	int id;
+	char *name;
+	char *address;
+	int port;
+	int log_level;
+	int poll_timeout;
+	int max_connections;
+	int retry_after;
+	int drain_timeout;
+	size_t compress_min_size;
+	char *channels_uri;
+	char *publish_uri;
+	char *stats_uri;
+	char *pubkey;
+	struct cps_dynamic dynamic;
+	struct cps_channel_conf *channels;
+	int nchannels;
+	struct cps_sequencer *sequencer; // shared by the replicas, once one is started
+	int *connections;
+};
+
+// What every worker is to run, from the configuration file or the command
+// line. A reload hands it from worker to worker, each bringing its replicas in
+// line with it, and then frees it along with the counters (and closes the
+// logs) the replicas of removed servers and channels shared.
+struct cps_config {
+	struct cps_server_conf *servers;
+	int nservers;
+	int log_level;
+	int visited;               // workers which have applied it
+	struct cps_garbage {
+		void *p;
+		void (*release)(void *);
+	} *garbage;
+	int ngarbage;
+};
+
+// Settings from the command line, which the configuration file falls back on
+struct cps_defaults {
+	const char *address;
+	int port;
+	int log_level;
+	int poll_timeout;
+	int max_connections;
+	const char *pubkey;
+	const char *channel;
+	bool dynamic;
+};
+
+
+typedef struct cps_channel cps_channel_t;
+typedef struct cps_server cps_server_t;
+typedef struct cps_sub cps_sub_t;
+typedef struct cps_body cps_body_t;
+typedef struct cps_msg cps_msg_t;
+typedef struct cps_blob cps_blob_t;
+typedef struct cps_envelope cps_envelope_t;
+typedef struct cps_query cps_query_t;
+typedef struct cps_worker cps_worker_t;
+
+struct cps_servers g_servers;
+int g_verbosity = 1;
+cps_worker_t *g_workers = NULL;
+int g_nworkers = 1;
+
+static struct cps_sequencer *cps_sequencer_new(void);
+static void cps_sequencer_push(struct cps_sequencer *sequencer, cps_msg_t *msg);
+static bool cps_sequencer_full(struct cps_sequencer *sequencer);
+static void cps_sequencer_raise(struct cps_sequencer *sequencer, uint64_t seq);
+static void cps_worker_call(cps_worker_t *worker, void (*call)(cps_worker_t *, void *), void *arg);
+static cps_server_t *cps_worker_server(cps_worker_t *worker, int id);
+static int cps_upgrade_take(const char *name, int worker, uint64_t *seq);
+cps_channel_t *cps_channel_find(cps_server_t *server, const char *name);
+static cps_channel_t *cps_channel_open_dynamic(cps_server_t *server, const char *name);
+static int cps_selector_normalize(char *dst, size_t size, const char *list);
+static bool cps_channel_name_valid(const char *name, bool pattern);
+static cps_channel_t *cps_channel_open_selector(cps_server_t *server, const char *selector);
+
+static const char *_evhttp_peername(struct evhttp_connection *evcon, char *buf, size_t bufsize) {
+	char *address;
+	u_short port;
+	evhttp_connection_get_peer(evcon, &address, &port);
+	snprintf(buf, bufsize, "%s:%d", address, port);
+	return (buf);
+}
+
+
+// Microseconds on the monotonic clock, for timing.
+static uint64_t cps_now_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Decodes %XX escapes and '+' in <s> in place.
+static char *_cps_uri_decode(char *s) {
+	char *src, *dst, hex[3] = { 0, 0, 0 };
+	for (src = dst = s; *src; src++, dst++) {
+		if (*src == '+') {
+			*dst = ' ';
+		}
+		else if (*src == '%' && isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2])) {
+			hex[0] = src[1];
+			hex[1] = src[2];
+			*dst = (char)strtol(hex, NULL, 16);
+			src += 2;
+		}
+		else {
+			*dst = *src;
+		}
+	}
+	*dst = '\0';
+	return s;
+}
+
+
+// Parses the query string of <uri> into scratch space from <worker>'s pool.
+// Returns NULL if there is no query string (or no memory). Release the
+// result with cps_query_free.
+static cps_query_t *cps_query_parse(cps_worker_t *worker, const char *uri) {
+	const char *qs = strchr(uri, '?');
+	cps_query_t *query;
+	char *p, *next, *value;
+	size_t length;
+	
+	if (!qs || !(query = slab_alloc(&worker->queries)))
+		return NULL;
+	length = strlen(++qs);
+	query->buf = length < sizeof(query->data) ? query->data : malloc(length + 1);
+	if (!query->buf) {
+		slab_free(&worker->queries, query);
+		return NULL;
+	}
+	memcpy(query->buf, qs, length + 1);
+	query->count = 0;
+	for (p = query->buf; p && *p && query->count < MAX_QUERY_PARAMS; p = next) {
+		if ((next = strchr(p, '&')))
+			*next++ = '\0';
+		if ((value = strchr(p, '=')))
+			*value++ = '\0';
+		else
+			value = p + strlen(p);
+		query->params[query->count].key = _cps_uri_decode(p);
+		query->params[query->count].value = _cps_uri_decode(value);
+		query->count++;
+	}
+	return query;
+}
+
+
+static const char *cps_query_get(const cps_query_t *query, const char *key) {
+	int i;
+	if (!query)
+		return NULL;
+	for (i = 0; i < query->count; i++) {
+		if (strcasecmp(query->params[i].key, key) == 0)
+			return query->params[i].value;
+	}
+	return NULL;
+}
+
+
+static void cps_query_free(cps_worker_t *worker, cps_query_t *query) {
+	if (!query)
+		return;
+	if (query->buf != query->data)
+		free(query->buf);
+	slab_free(&worker->queries, query);
+}
+
+
+static void cps_sub_parse_query(cps_sub_t *sub, const cps_query_t *query) {
+	const char *value;
+	
+	sub->format = CPS_FORMAT_JSONP;
+	strcpy(sub->jsonp, DEFAULT_JSONP_CALLBACK);
+	
+	if ((value = cps_query_get(query, "jsonp")) && *value) {
+		if (strlen(value) < sizeof(sub->jsonp))
+			strcpy(sub->jsonp, value);
+		else
+			cps_sub_log_warn(sub, "jsonp callback too long -- using \"%s\"", sub->jsonp);
+	}
+	if ((value = cps_query_get(query, "since")) && *value) {
+		sub->has_since = true;
+		sub->since = strtoull(value, NULL, 10);
+	}
+	if ((value = cps_query_get(query, "stream")) && *value && strcmp(value, "0") != 0) {
+		sub->stream = true;
+		sub->format = CPS_FORMAT_SCRIPT;
+	}
+	if ((value = cps_query_get(query, "batch"))) {
+		sub->batch = true;
+		sub->linger = atoi(value);
+		if (sub->linger < 0)
+			sub->linger = 0;
+		else if (sub->linger > MAX_BATCH_LINGER)
+			sub->linger = MAX_BATCH_LINGER;
+	}
+}
+
+
+// Returns the encoding to answer with, given an Accept-Encoding header:
+// gzip if accepted, otherwise deflate if accepted, otherwise none. Codings
+// with a q-value of 0 are not accepted.
+static enum cps_encoding cps_encoding_parse(const char *value) {
+	bool accepted[CPS_ENCODINGS] = { false };
+	const char *p, *end, *q;
+	size_t length;
+	int i;
+	
+	for (p = value; *p; p = *end ? end + 1 : end) {
+		p += strspn(p, " \t");
+		end = p + strcspn(p, ",");
+		length = strcspn(p, " \t;,");
+		if ((q = memchr(p, ';', end - p)) && (q = strstr(q, "q=")) && q < end && strtod(q + 2, NULL) == 0)
+			continue;
+		for (i = 1; i < CPS_ENCODINGS; i++) {
+			if (length == strlen(cps_encoding_names[i]) && strncasecmp(p, cps_encoding_names[i], length) == 0)
+				accepted[i] = true;
+		}
+	}
+	if (accepted[CPS_ENCODING_GZIP])
+		return CPS_ENCODING_GZIP;
+	return accepted[CPS_ENCODING_DEFLATE] ? CPS_ENCODING_DEFLATE : CPS_ENCODING_IDENTITY;
+}
+
+
+// Server-Sent Events subscribers are recognized by their Accept header and
+// resume from the Last-Event-ID header, which carries the last seq they saw.
+// Long-polling subscribers have their Accept-Encoding recorded instead.
+static void cps_sub_parse_headers(cps_sub_t *sub) {
+	const char *value;
+	
+	if (!(value = evhttp_find_header(sub->req->input_headers, "Accept"))
+		|| !strstr(value, "text/event-stream"))
+	{
+		if (!sub->stream && (value = evhttp_find_header(sub->req->input_headers, "Accept-Encoding")))
+			sub->encoding = cps_encoding_parse(value);
+		return;
+	}
+	sub->stream = true;
+	sub->format = CPS_FORMAT_SSE;
+	sub->jsonp[0] = '\0';
+	if ((value = evhttp_find_header(sub->req->input_headers, "Last-Event-ID")) && *value) {
+		sub->has_since = true;
+		sub->since = strtoull(value, NULL, 10);
+	}
+}
+
+
+// Writes a final, unmasked WebSocket frame header to <p> and returns its length
+static size_t cps_ws_frame_header(uint8_t *p, int opcode, size_t length) {
+	int i;
+	p[0] = 0x80 | opcode;
+	if (length < 126) {
+		p[1] = (uint8_t)length;
+		return 2;
+	}
+	if (length < 0x10000) {
+		p[1] = 126;
+		p[2] = (uint8_t)(length >> 8);
+		p[3] = (uint8_t)length;
+		return 4;
+	}
+	p[1] = 127;
+	for (i = 0; i < 8; i++)
+		p[2 + i] = (uint8_t)((uint64_t)length >> (56 - i * 8));
+	return 10;
+}
+
+
+// Writes what goes before and after the payload of <msg> framed for <format>
+// to <head> and <tail>, and their lengths to <head_len> and <tail_len>.
+// <named> messages (for subscribers of several channels) also tell their
+// channel: as a third callback argument, or as the event type of an event
+// stream. The name is written as it is, since _cps_channel_open only opens
+// channels whose names need no escaping there.
+static void cps_format_frame(char *head, size_t *head_len, char *tail, size_t *tail_len, int format,
+	const char *jsonp, const cps_msg_t *msg, bool named)
+{
+	if (format == CPS_FORMAT_SSE) {
+		*head_len = snprintf(head, FORMAT_HEAD_MAX, "%s%s%sid: %llu\ndata: ", named ? "event: " : "",
+			named ? msg->channel : "", named ? "\n" : "", (unsigned long long)msg->seq);
+		*tail_len = snprintf(tail, FORMAT_TAIL_MAX, "\n\n");
+	}
+	else if (format == CPS_FORMAT_WS) {
+		*head_len = cps_ws_frame_header((uint8_t *)head, 0x1, msg->length);
+		*tail_len = 0;
+	}
+	else {
+		*head_len = snprintf(head, FORMAT_HEAD_MAX, "%s%s(", cps_format_open[format], jsonp);
+		*tail_len = snprintf(tail, FORMAT_TAIL_MAX, ", %llu%s%s%s);%s", (unsigned long long)msg->seq,
+			named ? ", \"" : "", named ? msg->channel : "", named ? "\"" : "", cps_format_close[format]);
+	}
+}
+
+
+// Writes <msg> framed for <format> to <dst>, unless <dst> is NULL, and returns
+// the length of the framed message. Event stream data may not contain line
+// breaks, so every line of the message gets its own "data:" field.
+static size_t cps_format_render(char *dst, int format, const char *jsonp, const cps_msg_t *msg,
+	bool named)
+{
+	char head[FORMAT_HEAD_MAX], tail[FORMAT_TAIL_MAX];
+	size_t head_len, tail_len, length;
+	const char *p, *end = msg->data + msg->length, *nl;
+	
+	cps_format_frame(head, &head_len, tail, &tail_len, format, jsonp, msg, named);
+	length = head_len;
+	if (dst)
+		memcpy(dst, head, head_len);
+	for (p = msg->data; p < end; p = nl + 1) {
+		if (format != CPS_FORMAT_SSE || !(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		if (dst)
+			memcpy(dst + length, p, nl - p);
+		length += nl - p;
+		if (nl < end) {
+			if (dst)
+				memcpy(dst + length, "\ndata: ", 7);
+			length += 7;
+		}
+	}
+	if (dst)
+		memcpy(dst + length, tail, tail_len);
+	return length + tail_len;
+}
+
+
+// Appends a batched JSONP call for <count> messages to <buf>:
+// "callback([m1,m2,...], seq)" with the seq of the last one, followed on
+// selector channels by the list of channels the messages came from, quoted
+// but not escaped, as channel names never need it.
+static void cps_batch_render(struct evbuffer *buf, const char *jsonp, cps_msg_t **msgs, int count, bool named) {
+	int i;
+	evbuffer_add_printf(buf, "%s([", jsonp);
+	for (i = 0; i < count; i++) {
+		if (i > 0)
+			evbuffer_add(buf, ",", 1);
+		evbuffer_add(buf, msgs[i]->data, msgs[i]->length);
+	}
+	evbuffer_add_printf(buf, "], %llu", (unsigned long long)msgs[count - 1]->seq);
+	if (named) {
+		evbuffer_add(buf, ", [", 3);
+		for (i = 0; i < count; i++)
+			evbuffer_add_printf(buf, "%s\"%s\"", i > 0 ? "," : "", msgs[i]->channel);
+		evbuffer_add(buf, "]", 1);
+	}
+	evbuffer_add(buf, ");", 2);
+}
+
+
+static void _cps_sub_written_cb(struct evhttp_connection *evcon, void *_sub);
+
+// Sends <buf> as the next chunk of a streaming response. Once the connection
+// has written it, anything queued for the subscriber meanwhile is sent.
+static void cps_sub_send_chunk(cps_sub_t *sub, struct evbuffer *buf) {
+	evhttp_send_reply_chunk_with_cb(sub->req, buf, _cps_sub_written_cb, sub);
+}
+
+
+// A catchup response being written
+struct cps_catchup {
+	cps_sub_t *sub;
+	struct evbuffer *buf;
+	bool named;
+	int count;                       // messages written
+	uint64_t last_seq;               // of the last one
+	int nbatch;                      // in the batched call being written
+	const char *names[MAX_BATCH];    // of their channels
+	msglog_seg_t *seg;               // holding the message being written, if replayed
+};
+
+
+static void _cps_catchup_unpin_cb(const void *data, size_t length, void *seg) {
+	msglog_seg_release((msglog_seg_t *)seg);
+}
+
+
+// Adds part of a message's payload to the catchup response. Payloads replayed
+// from a log are referenced where they are mapped, keeping their segment
+// mapped until the response is sent, rather than copied.
+static void cps_catchup_add_data(struct cps_catchup *c, const char *data, size_t length) {
+	if (!c->seg || length == 0) {
+		evbuffer_add(c->buf, data, length);
+		return;
+	}
+	msglog_seg_retain(c->seg);
+	if (evbuffer_add_reference(c->buf, data, length, _cps_catchup_unpin_cb, c->seg) != 0)
+		msglog_seg_release(c->seg);
+}
+
+
+// Closes the batched call being written, like cps_batch_render does.
+static void cps_catchup_end_batch(struct cps_catchup *c) {
+	int i;
+	if (c->nbatch == 0)
+		return;
+	evbuffer_add_printf(c->buf, "], %llu", (unsigned long long)c->last_seq);
+	if (c->named) {
+		evbuffer_add(c->buf, ", [", 3);
+		for (i = 0; i < c->nbatch; i++)
+			evbuffer_add_printf(c->buf, "%s\"%s\"", i > 0 ? "," : "", c->names[i]);
+		evbuffer_add(c->buf, "]", 1);
+	}
+	evbuffer_add(c->buf, ");", 2);
+	c->nbatch = 0;
+}
+
+
+// Writes <msg> to the catchup response: on its own, or into the batched call
+// being written (rendered like cps_batch_render, a message at a time, so that
+// messages replayed from a log need not outlive the replay).
+static void cps_catchup_add(struct cps_catchup *c, cps_msg_t *msg) {
+	char head[FORMAT_HEAD_MAX], tail[FORMAT_TAIL_MAX];
+	const char *p, *end = msg->data + msg->length, *nl;
+	cps_sub_t *sub = c->sub;
+	struct evbuffer_iovec vec;
+	size_t length, head_len, tail_len;
+	
+	if (sub->batch && !sub->stream) {
+		if (c->nbatch == 0)
+			evbuffer_add_printf(c->buf, "%s([", sub->jsonp);
+		else
+			evbuffer_add(c->buf, ",", 1);
+		cps_catchup_add_data(c, msg->data, msg->length);
+		c->names[c->nbatch++] = msg->channel;
+		c->last_seq = msg->seq;  // closes the call
+		if (c->nbatch == MAX_BATCH)
+			cps_catchup_end_batch(c);
+	}
+	else if (c->seg) {
+		// framed like cps_format_render, around the payload left in place
+		cps_format_frame(head, &head_len, tail, &tail_len, sub->format, sub->jsonp, msg, c->named);
+		evbuffer_add(c->buf, head, head_len);
+		for (p = msg->data; p < end; p = nl + 1) {
+			if (sub->format != CPS_FORMAT_SSE || !(nl = memchr(p, '\n', end - p)))
+				nl = end;
+			cps_catchup_add_data(c, p, nl - p);
+			if (nl < end)
+				evbuffer_add(c->buf, "\ndata: ", 7);
+		}
+		evbuffer_add(c->buf, tail, tail_len);
+	}
+	else {
+		length = cps_format_render(NULL, sub->format, sub->jsonp, msg, c->named);
+		if (evbuffer_reserve_space(c->buf, length, &vec, 1) < 1)
+			return;
+		vec.iov_len = cps_format_render(vec.iov_base, sub->format, sub->jsonp, msg, c->named);
+		evbuffer_commit_space(c->buf, &vec, 1);
+	}
+	c->last_seq = msg->seq;
+	c->count++;
+}
+
+
+// Writes a message from the channel's log, referencing its payload in the
+// mapping of its segment.
+static bool _cps_catchup_replay_cb(const msglog_entry_t *entry, void *_catchup) {
+	struct cps_catchup *c = (struct cps_catchup *)_catchup;
+	cps_msg_t msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.server_id = c->sub->channel->server->id;
+	msg.seq = entry->seq;
+	msg.channel = c->sub->channel->name;
+	msg.data = entry->data;
+	msg.length = entry->length;
+	c->seg = entry->seg;
+	cps_catchup_add(c, &msg);
+	c->seg = NULL;
+	return true;
+}
+
+
+// Marks a long-poll reply to <sub> as depending on Accept-Encoding whenever it
+// could have been compressed, so that caches do not hand a body of one encoding
+// to a client which asked for another, even when this one was sent as is.
+static void cps_sub_add_vary(cps_sub_t *sub) {
+	if (sub->channel->server->compress_min_size || sub->encoding != CPS_ENCODING_IDENTITY)
+		evhttp_add_header(sub->req->output_headers, "Vary", "Accept-Encoding");
+}
+
+
+// Answers a subscriber which passed ?since=<seq> right away with every message
+// in the channel history newer than <seq>, all in one response (or one chunk
+// when streaming, or batched calls of up to MAX_BATCH messages when batching).
+// A channel which keeps a log sends what is older than its history (or kept
+// from before a restart) from the log, up to MAX_REPLAY messages at once.
+// Returns false if there was nothing to catch up on.
+static bool cps_sub_catchup(cps_sub_t *sub) {
+	cps_channel_t *ch = sub->channel;
+	struct cps_history *h = &ch->history;
+	struct cps_catchup c;
+	uint64_t since = sub->since;
+	cps_msg_t *msg;
+	size_t before;
+	int i;
+	
+	memset(&c, 0, sizeof(c));
+	c.sub = sub;
+	c.named = ch->selector;
+	if (sub->ws)
+		c.buf = bufferevent_get_output(sub->ws);
+	else
+		c.buf = sub->stream ? ch->server->worker->scratch : sub->req->output_buffer;
+	before = evbuffer_get_length(c.buf);
+	if (ch->log && (h->count == 0 || h->msgs[h->head]->seq > since)) {
+		if (msglog_replay(ch->log, since, MAX_REPLAY, _cps_catchup_replay_cb, &c) == MAX_REPLAY)
+			h = NULL; // the rest comes with the next catchup
+		else if (c.count > 0)
+			since = c.last_seq;
+	}
+	for (i = 0; h && i < h->count; i++) {
+		msg = h->msgs[(h->head + i) % h->size];
+		if (msg->seq > since)
+			cps_catchup_add(&c, msg);
+	}
+	cps_catchup_end_batch(&c);
+	if (c.count == 0)
+		return false;
+	
+	ch->stats.deliveries += c.count;
+	ch->stats.bytes_out += evbuffer_get_length(c.buf) - before;
+	cps_sub_log_debug(sub, "sending %d missed messages(%llu)", c.count,
+		(unsigned long long)EVBUFFER_LENGTH(c.buf));
+	if (sub->ws) {
+		// written by the bufferevent
+	}
+	else if (sub->stream) {
+		cps_sub_send_chunk(sub, c.buf);
+	}
+	else {
+		evhttp_add_header(sub->req->output_headers, "Content-Type", cps_format_content_type[sub->format]);
+		cps_sub_add_vary(sub);
+		evhttp_send_reply(sub->req, 200, "OK", NULL);
+	}
+	return true;
+}
+
+
+// Restarts the idle timeout of a dynamic channel which has no subscribers, and
+// stops it while there are some. Called whenever subscribers come or go and
+// on every publish.
+static void cps_channel_touch(cps_channel_t *ch) {
+	cps_server_t *server = ch->server;
+	if (!ch->dynamic)
+		return;
+	if (TAILQ_EMPTY(&ch->subs) && server->dynamic.idle_timeout > 0)
+		twheel_add(&server->idle_wheel, &ch->idle_timer, server->dynamic.idle_timeout * 1000 / TIMER_TICK_MS);
+	else
+		twheel_del(&server->idle_wheel, &ch->idle_timer);
+}
+
+
+// Adds <sub> to the subscribers of <ch>.
+static void cps_channel_attach(cps_channel_t *ch, cps_sub_t *sub) {
+	// messages already in the history are not sent to it by fanouts in progress
+	sub->mark = ch->published;
+	TAILQ_INSERT_TAIL(&ch->subs, sub, next);
+	ch->nsubs++;
+	__atomic_add_fetch(ch->clients, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(ch->server->connections, 1, __ATOMIC_RELAXED);
+	cps_channel_touch(ch);
+}
+
+
+// Turns away a subscriber to <ch> with 503 and a Retry-After header.
+static void cps_channel_refuse(cps_channel_t *ch, struct evhttp_request *req) {
+	char retry_after[16];
+	snprintf(retry_after, sizeof(retry_after), "%d", ch->server->retry_after);
+	evhttp_add_header(req->output_headers, "Retry-After", retry_after);
+	evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+}
+
+
+// Returns true if <ch> and its server may take another subscriber. Otherwise
+// the request is answered with 503 and a Retry-After header right away, before
+// anything is allocated for it. The limits count subscribers on all workers,
+// and are checked without locking, so concurrent subscribers on different
+// workers may overshoot them by a few.
+static bool cps_channel_admit(cps_channel_t *ch, struct evhttp_request *req) {
+	cps_server_t *server = ch->server;
+	
+	if (ch->max_clients > 0 && __atomic_load_n(ch->clients, __ATOMIC_RELAXED) >= ch->max_clients) {
+		cps_channel_log_debug(ch, "max_clients (%d) reached -- turning away %s:%d",
+			ch->max_clients, req->remote_host, req->remote_port);
+		ch->stats.rejected++;
+	}
+	else if (server->max_connections > 0
+		&& __atomic_load_n(server->connections, __ATOMIC_RELAXED) >= server->max_connections)
+	{
+		cps_channel_log_debug(ch, "max_connections (%d) reached -- turning away %s:%d",
+			server->max_connections, req->remote_host, req->remote_port);
+		server->rejected++;
+	}
+	else {
+		return true;
+	}
+	cps_channel_refuse(ch, req);
+	return false;
+}
+
+
+static void cps_sub_dequeue(cps_sub_t *sub);
+
+// Unlinks <sub> from its channel, timer and connection and frees it. Answering
+// (or closing) the request is up to the caller.
+void cps_sub_delete(cps_sub_t *sub) {
+	cps_channel_t *ch = sub->channel;
+	while (!TAILQ_EMPTY(&sub->queue))
+		cps_sub_dequeue(sub);
+	if (ch->cursor == sub)
+		ch->cursor = TAILQ_NEXT(sub, next);
+	TAILQ_REMOVE(&ch->subs, sub, next);
+	ch->nsubs--;
+	__atomic_sub_fetch(ch->clients, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(ch->server->connections, 1, __ATOMIC_RELAXED);
+	cps_channel_touch(ch);
+	twheel_del(&sub->channel->server->wheel, &sub->timer);
+	if (event_initialized(&sub->ev))
+		event_del(&sub->ev);
+	if (event_initialized(&sub->batch_ev))
+		event_del(&sub->batch_ev);
+	if (!sub->ws && sub->req->evcon)
+		evhttp_connection_set_closecb(sub->req->evcon, NULL, NULL);
+	slab_free(&sub->channel->server->worker->subs, sub);
+}
+
+
+// Called by evhttp when a subscriber's connection goes away, so that dead
+// subscribers are unlinked right away rather than on the next publish. When
+// the client dropped the connection, evhttp has already detached our
+// unanswered request from it and leaves freeing the request to us.
+static void _cps_sub_close_cb(struct evhttp_connection *evcon, void *_sub) {
+	cps_sub_t *sub = (cps_sub_t *)_sub;
+	struct evhttp_request *req = sub->req;
+	cps_sub_log_info(sub, "disconnected");
+	cps_sub_delete(sub);
+	if (req->evcon == NULL)
+		evhttp_request_free(req);
+}
+
+
+static void cps_sub_close(cps_sub_t *sub, int ws_status);
+
+// evhttp does not read from a connection while its request is unanswered, so
+// we watch the socket ourselves. If the client closed it, freeing the
+// connection unlinks the subscriber through _cps_sub_close_cb. A client which
+// sends another request meanwhile (pipelining it) is answered right away, as
+// a timeout would: evhttp then reads the next request, and notices the client
+// going away again itself. Waiting on instead would leave the data unread and
+// the disconnect unnoticed.
+static void _cps_sub_readable_cb(int fd, short what, void *_sub) {
+	cps_sub_t *sub = (cps_sub_t *)_sub;
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK);
+	if (n > 0) {
+		cps_sub_log_debug(sub, "pipelined request -- answering now");
+		cps_sub_close(sub, 1000);
+		return;
+	}
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	evhttp_connection_free(sub->req->evcon);
+}
+
+
+// Starts a streaming response which stays open, sending each message as a
+// chunk. For forever-frames, the 4 kB whitespace prelude makes browsers start
+// rendering (and thus running the scripts of) the response right away
+// instead of buffering it.
+static void cps_sub_stream_start(cps_sub_t *sub) {
+	struct evbuffer *buf = sub->channel->server->worker->scratch;
+	evhttp_add_header(sub->req->output_headers, "Content-Type", cps_format_content_type[sub->format]);
+	evhttp_add_header(sub->req->output_headers, "Cache-Control", "no-cache");
+	if (sub->format == CPS_FORMAT_SSE)
+		evhttp_add_header(sub->req->output_headers, "Access-Control-Allow-Origin", "*");
+	evhttp_send_reply_start(sub->req, 200, "OK");
+	if (sub->format == CPS_FORMAT_SCRIPT) {
+		evbuffer_add_reference(buf, g_4k_sp, sizeof(g_4k_sp), NULL, NULL);
+		cps_sub_send_chunk(sub, buf);
+	}
+}
+
+
+static void _cps_sub_batch_cb(int fd, short what, void *_sub);
+
+static cps_sub_t *cps_sub_open(cps_channel_t *ch, struct evhttp_request *req) {
+	cps_worker_t *worker = ch->server->worker;
+	cps_query_t *query;
+	cps_sub_t *sub;
+	if (!(sub = slab_calloc(&worker->subs))) {
+		cps_channel_log_err(ch, "failed to allocate subscriber for %s:%d", req->remote_host, req->remote_port);
+		cps_channel_refuse(ch, req);
+		return NULL;
+	}
+	sub->req = req;
+	sub->channel = ch;
+	TAILQ_INIT(&sub->queue);
+	query = cps_query_parse(worker, req->uri);
+	cps_sub_parse_query(sub, query);
+	cps_query_free(worker, query);
+	cps_sub_parse_headers(sub);
+	if (sub->stream)
+		cps_sub_stream_start(sub);
+	if (sub->has_since && cps_sub_catchup(sub) && !sub->stream) {
+		slab_free(&worker->subs, sub);
+		return NULL;
+	}
+	cps_channel_attach(ch, sub);
+	evhttp_connection_set_closecb(req->evcon, _cps_sub_close_cb, sub);
+	event_set(&sub->ev, bufferevent_getfd(evhttp_connection_get_bufferevent(req->evcon)),
+		EV_READ|EV_PERSIST, _cps_sub_readable_cb, sub);
+	event_base_set(ch->server->worker->base, &sub->ev);
+	event_add(&sub->ev, NULL);
+	if (!sub->stream && ch->server->poll_timeout > 0)
+		twheel_add(&ch->server->wheel, &sub->timer, ch->server->poll_timeout * 1000 / TIMER_TICK_MS);
+	if (sub->batch && !sub->stream) {
+		event_set(&sub->batch_ev, -1, 0, _cps_sub_batch_cb, sub);
+		event_base_set(ch->server->worker->base, &sub->batch_ev);
+	}
+	cps_sub_log_info(sub, "listening");
+	return sub;
+}
+
+
+// Copies <length> bytes of <buf> into a new blob.
+static cps_blob_t *cps_blob_new(struct evbuffer *buf, size_t length) {
+	cps_blob_t *blob;
+	if (!(blob = malloc(sizeof(cps_blob_t) + length)))
+		return NULL;
+	blob->length = evbuffer_copyout(buf, blob->data, length);
+	blob->refcount = 1;
+	return blob;
+}
+
+
+static void cps_blob_release(cps_blob_t *blob) {
+	if (__atomic_sub_fetch(&blob->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(blob);
+}
+
+
+// Creates a message for <ch>, to be numbered by the sequencer of its server.
+// The reference returned is handed on to the sequencer by cps_sequencer_push.
+// The payload is copied, unless <blob> is given and holds <data>, in which
+// case the message references the blob instead.
+static cps_msg_t *cps_msg_new(cps_channel_t *ch, const char *sender, const char *key, const char *data,
+	size_t length, cps_blob_t *blob)
+{
+	size_t chlen = strlen(ch->name) + 1, senderlen = strlen(sender) + 1, keylen = key ? strlen(key) + 1 : 0;
+	cps_msg_t *msg;
+	char *p;
+	
+	if (!(msg = malloc(sizeof(cps_msg_t) + chlen + senderlen + keylen + (blob ? 0 : length))))
+		return NULL;
+	p = (char *)(msg + 1);
+	msg->channel = memcpy(p, ch->name, chlen);
+	msg->sender = memcpy(p + chlen, sender, senderlen);
+	msg->key = key ? memcpy(p + chlen + senderlen, key, keylen) : NULL;
+	if (blob) {
+		__atomic_add_fetch(&blob->refcount, 1, __ATOMIC_RELAXED);
+		msg->data = data;
+	}
+	else {
+		msg->data = memcpy(p + chlen + senderlen + keylen, data, length);
+	}
+	msg->blob = blob;
+	msg->length = length;
+	msg->server_id = ch->server->id;
+	msg->seq = 0;
+	msg->refcount = 1;
+	return msg;
+}
+
+
+static void cps_msg_retain(cps_msg_t *msg) {
+	__atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+static void cps_msg_release(cps_msg_t *msg) {
+	if (__atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (msg->blob)
+			cps_blob_release(msg->blob);
+		free(msg);
+	}
+}
+
+
+// Changes the size of <h>, keeping as many of the newest messages as fit.
+static int cps_history_resize(struct cps_history *h, int size) {
+	cps_msg_t **msgs = NULL;
+	int count, i;
+	
+	if (size < 0)
+		size = 0;
+	if (size && !(msgs = calloc(size, sizeof(cps_msg_t *))))
+		return -1;
+	count = h->count < size ? h->count : size;
+	for (i = 0; i < h->count; i++) {
+		if (i < h->count - count)
+			cps_msg_release(h->msgs[(h->head + i) % h->size]);
+		else
+			msgs[i - (h->count - count)] = h->msgs[(h->head + i) % h->size];
+	}
+	free(h->msgs);
+	h->msgs = msgs;
+	h->size = size;
+	h->count = count;
+	h->head = 0;
+	return 0;
+}
+
+
+static void cps_history_add(struct cps_history *h, cps_msg_t *msg) {
+	if (h->size == 0)
+		return;
+	cps_msg_retain(msg);
+	if (h->count < h->size) {
+		h->msgs[(h->head + h->count++) % h->size] = msg;
+	}
+	else {
+		cps_msg_release(h->msgs[h->head]);
+		h->msgs[h->head] = msg;
+		h->head = (h->head + 1) % h->size;
+	}
+}
+
+
+static void cps_history_clear(struct cps_history *h) {
+	int i;
+	for (i = 0; i < h->count; i++)
+		cps_msg_release(h->msgs[(h->head + i) % h->size]);
+	free(h->msgs);
+	h->msgs = NULL;
+	h->size = h->count = h->head = 0;
+}
+
+
+static int cps_body_cmp(cps_body_t *a, cps_body_t *b) {
+	if (a->format != b->format)
+		return a->format - b->format;
+	if (a->encoding != b->encoding)
+		return a->encoding - b->encoding;
+	return strcmp(a->jsonp, b->jsonp);
+}
+RB_GENERATE(cps_bodies, cps_body, entry, cps_body_cmp);
+
+
+// Allocates a body with room for <length> bytes of data. Small bodies (the
+// common case) come from <worker>'s pool. Bodies are only referenced by the
+// connections of the worker which rendered them, so they are released on that
+// worker's thread too.
+static cps_body_t *cps_body_alloc(cps_worker_t *worker, int format, int encoding, const char *jsonp,
+	size_t length)
+{
+	cps_body_t *body;
+	size_t jsonp_len = strlen(jsonp), size = sizeof(cps_body_t) + jsonp_len + 1 + length;
+	if (size <= BODY_SLAB_SIZE) {
+		if (!(body = slab_alloc(&worker->bodies)))
+			return NULL;
+		body->slab = &worker->bodies;
+	}
+	else {
+		if (!(body = malloc(size)))
+			return NULL;
+		body->slab = NULL;
+	}
+	body->format = format;
+	body->encoding = encoding;
+	body->jsonp = (char *)(body + 1);
+	memcpy(body->jsonp, jsonp, jsonp_len + 1);
+	body->data = body->jsonp + jsonp_len + 1;
+	body->length = length;
+	body->refcount = 1;
+	return body;
+}
+
+
+static cps_body_t *cps_body_new(cps_worker_t *worker, int format, const char *jsonp, const cps_msg_t *msg,
+	bool named)
+{
+	cps_body_t *body;
+	if ((body = cps_body_alloc(worker, format, CPS_ENCODING_IDENTITY, jsonp,
+		cps_format_render(NULL, format, jsonp, msg, named))))
+	{
+		cps_format_render(body->data, format, jsonp, msg, named);
+	}
+	return body;
+}
+
+
+static void cps_body_release(cps_body_t *body) {
+	if (--body->refcount > 0)
+		return;
+	if (body->slab)
+		slab_free(body->slab, body);
+	else
+		free(body);
+}
+
+
+// Returns a copy of <src> compressed for <encoding>. Each worker keeps one
+// deflate stream per encoding and resets it for every body.
+static cps_body_t *cps_body_compress(cps_worker_t *worker, const cps_body_t *src, int encoding) {
+	z_stream *zs = worker->deflate[encoding];
+	cps_body_t *body;
+	
+	if (!zs) {
+		if (!(zs = calloc(1, sizeof(z_stream))))
+			return NULL;
+		// 16 added to the window bits asks for a gzip rather than a zlib wrapper
+		if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, encoding == CPS_ENCODING_GZIP ? 15 + 16 : 15,
+			8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(zs);
+			return NULL;
+		}
+		worker->deflate[encoding] = zs;
+	}
+	else {
+		deflateReset(zs);
+	}
+	if (!(body = cps_body_alloc(worker, src->format, encoding, src->jsonp, deflateBound(zs, src->length))))
+		return NULL;
+	zs->next_in = (Bytef *)src->data;
+	zs->avail_in = src->length;
+	zs->next_out = (Bytef *)body->data;
+	zs->avail_out = body->length;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+		cps_body_release(body);
+		return NULL;
+	}
+	body->length = zs->total_out;
+	return body;
+}
+
+
+static void _cps_body_unref_cb(const void *data, size_t datalen, void *_body) {
+	cps_body_release((cps_body_t *)_body);
+}
+
+
+// Returns the body for <format> and <jsonp>, rendering it the first time it is
+// requested during a publish. Bodies of at least <min_size> bytes are also
+// compressed once for each <encoding> asked for; smaller ones are not worth it
+// and are sent as they are.
+static cps_body_t *cps_body_get(cps_worker_t *worker, struct cps_bodies *bodies, int format,
+	const char *jsonp, const cps_msg_t *msg, bool named, int encoding, size_t min_size)
+{
+	cps_body_t key, *body, *plain;
+	key.format = format;
+	key.encoding = encoding;
+	key.jsonp = (char *)jsonp;
+	if ((body = RB_FIND(cps_bodies, bodies, &key)))
+		return body;
+	if (encoding != CPS_ENCODING_IDENTITY) {
+		if (!(plain = cps_body_get(worker, bodies, format, jsonp, msg, named, CPS_ENCODING_IDENTITY, 0))
+			|| min_size == 0 || plain->length < min_size || !(body = cps_body_compress(worker, plain, encoding)))
+		{
+			return plain;
+		}
+	}
+	else if (!(body = cps_body_new(worker, format, jsonp, msg, named))) {
+		return NULL;
+	}
+	RB_INSERT(cps_bodies, bodies, body);
+	return body;
+}
+
+
+// Returns the output buffer of a streaming subscriber's connection.
+static struct evbuffer *cps_sub_output(cps_sub_t *sub) {
+	if (sub->ws)
+		return bufferevent_get_output(sub->ws);
+	return bufferevent_get_output(evhttp_connection_get_bufferevent(sub->req->evcon));
+}
+
+
+// Drops the oldest body queued for <sub>.
+static void cps_sub_dequeue(cps_sub_t *sub) {
+	struct cps_qent *qent = TAILQ_FIRST(&sub->queue);
+	TAILQ_REMOVE(&sub->queue, qent, next);
+	if (qent->msg) {
+		sub->queued--;
+		cps_msg_release(qent->msg);
+	}
+	else {
+		sub->queued -= qent->body->length;
+		cps_body_release(qent->body);
+	}
+	slab_free(&sub->channel->server->worker->qents, qent);
+}
+
+
+// Hands everything queued for a streaming subscriber to its connection, as a
+// single chunk (or right after each other, for WebSockets).
+static void cps_sub_flush(cps_sub_t *sub) {
+	struct cps_qent *qent;
+	struct evbuffer *buf;
+	
+	if (TAILQ_EMPTY(&sub->queue))
+		return;
+	buf = sub->ws ? bufferevent_get_output(sub->ws) : sub->channel->server->worker->scratch;
+	cps_sub_log_debug(sub, "sending queued messages(%llu)", (unsigned long long)sub->queued);
+	while ((qent = TAILQ_FIRST(&sub->queue))) {
+		// the queue's reference is handed to the buffer
+		if (evbuffer_add_reference(buf, qent->body->data, qent->body->length, _cps_body_unref_cb, qent->body) == -1)
+			cps_body_release(qent->body);
+		TAILQ_REMOVE(&sub->queue, qent, next);
+		slab_free(&sub->channel->server->worker->qents, qent);
+	}
+	sub->channel->stats.bytes_out += sub->queued;
+	sub->queued = 0;
+	if (!sub->ws)
+		cps_sub_send_chunk(sub, buf);
+}
+
+
+static void _cps_sub_written_cb(struct evhttp_connection *evcon, void *_sub) {
+	cps_sub_flush((cps_sub_t *)_sub);
+}
+
+
+static void cps_ws_close(cps_sub_t *sub);
+
+// Queues <body> for a streaming subscriber whose connection is still busy
+// writing. If that would put the subscriber more than max_buffer bytes behind,
+// the channel's overflow policy decides what gives. Returns false if the
+// subscriber was disconnected (and deleted).
+static bool cps_sub_enqueue(cps_sub_t *sub, cps_body_t *body) {
+	cps_channel_t *ch = sub->channel;
+	size_t pending = evbuffer_get_length(cps_sub_output(sub));
+	struct cps_qent *qent;
+	
+	if (ch->max_buffer > 0 && pending + sub->queued + body->length > ch->max_buffer) {
+		switch (ch->overflow) {
+		case CPS_OVERFLOW_DROP_OLDEST:
+			while (!TAILQ_EMPTY(&sub->queue) && pending + sub->queued + body->length > ch->max_buffer) {
+				cps_sub_dequeue(sub);
+				ch->stats.dropped++;
+			}
+			break;
+		case CPS_OVERFLOW_COALESCE:
+			while (!TAILQ_EMPTY(&sub->queue)) {
+				cps_sub_dequeue(sub);
+				ch->stats.coalesced++;
+			}
+			break;
+		case CPS_OVERFLOW_DISCONNECT:
+			cps_sub_log_info(sub, "%llu bytes behind -- disconnecting slow subscriber",
+				(unsigned long long)(pending + sub->queued));
+			ch->stats.evicted++;
+			if (sub->ws)
+				cps_ws_close(sub);
+			else
+				// unlinks the subscriber through _cps_sub_close_cb
+				evhttp_connection_free(sub->req->evcon);
+			return false;
+		}
+	}
+	if (!(qent = slab_alloc(&ch->server->worker->qents))) {
+		cps_sub_log_err(sub, "failed to queue message");
+		ch->stats.dropped++;
+		return true;
+	}
+	qent->body = body;
+	qent->msg = NULL;
+	body->refcount++;
+	TAILQ_INSERT_TAIL(&sub->queue, qent, next);
+	sub->queued += body->length;
+	return true;
+}
+
+
+// JSONP responder. Long-polling subscribers are answered and removed, streaming
+// subscribers get the body as another chunk and stay subscribed. While a
+// streaming connection is still writing earlier messages, new ones are queued
+// and sent together once it is done.
+static void cps_sub_pub(struct cps_sub *sub, cps_body_t *body) {
+	struct evbuffer *bodybuf;
+	
+	if (sub->ws_closing)
+		return;
+	if (sub->stream && (!TAILQ_EMPTY(&sub->queue) || evbuffer_get_length(cps_sub_output(sub)) > 0)) {
+		cps_sub_log_debug(sub, "queueing message(%llu)", (unsigned long long)body->length);
+		cps_sub_enqueue(sub, body);
+		return;
+	}
+	if (sub->ws)
+		bodybuf = bufferevent_get_output(sub->ws);
+	else
+		bodybuf = sub->stream ? sub->channel->server->worker->scratch : sub->req->output_buffer;
+	cps_sub_log_debug(sub, "sending message(%llu)", (unsigned long long)body->length);
+	sub->channel->stats.bytes_out += body->length;
+	body->refcount++;
+	if (evbuffer_add_reference(bodybuf, body->data, body->length, _cps_body_unref_cb, body) == -1)
+		body->refcount--;
+	
+	if (sub->ws)
+		return;
+	if (sub->stream) {
+		cps_sub_send_chunk(sub, bodybuf);
+		return;
+	}
+	
+	struct evhttp_request *req = sub->req;
+	evhttp_add_header(req->output_headers, "Content-Type", cps_format_content_type[sub->format]);
+	cps_sub_add_vary(sub);
+	if (body->encoding != CPS_ENCODING_IDENTITY)
+		evhttp_add_header(req->output_headers, "Content-Encoding", cps_encoding_names[body->encoding]);
+	cps_sub_delete(sub);
+	evhttp_send_reply(req, 200, "OK", NULL);
+}
+
+
+// Answers a batching long-poll subscriber with every message held for it, in
+// a single call, and removes it.
+static void cps_sub_send_batch(cps_sub_t *sub) {
+	struct evhttp_request *req = sub->req;
+	cps_msg_t *msgs[MAX_BATCH];
+	struct cps_qent *qent;
+	int count = 0;
+	
+	TAILQ_FOREACH(qent, &sub->queue, next)
+		msgs[count++] = qent->msg;
+	cps_sub_log_debug(sub, "sending %d messages", count);
+	cps_batch_render(req->output_buffer, sub->jsonp, msgs, count, sub->channel->selector);
+	sub->channel->stats.bytes_out += evbuffer_get_length(req->output_buffer);
+	evhttp_add_header(req->output_headers, "Content-Type", cps_format_content_type[sub->format]);
+	cps_sub_add_vary(sub);
+	cps_sub_delete(sub);
+	evhttp_send_reply(req, 200, "OK", NULL);
+}
+
+
+static void _cps_sub_batch_cb(int fd, short what, void *_sub) {
+	cps_sub_send_batch((cps_sub_t *)_sub);
+}
+
+
+// Holds <msg> for a batching long-poll subscriber, which is answered <linger>
+// ms after the first message (or right away, once MAX_BATCH have come in).
+static void cps_sub_hold(cps_sub_t *sub, cps_msg_t *msg) {
+	struct timeval linger = { sub->linger / 1000, (sub->linger % 1000) * 1000 };
+	struct cps_qent *qent;
+	
+	if (!(qent = slab_alloc(&sub->channel->server->worker->qents))) {
+		cps_sub_log_err(sub, "failed to hold message");
+		return;
+	}
+	cps_msg_retain(msg);
+	qent->msg = msg;
+	qent->body = NULL;
+	TAILQ_INSERT_TAIL(&sub->queue, qent, next);
+	if (++sub->queued == MAX_BATCH) {
+		cps_sub_send_batch(sub);
+	}
+	else if (sub->queued == 1) {
+		twheel_del(&sub->channel->server->wheel, &sub->timer);
+		event_add(&sub->batch_ev, &linger);
+	}
+}
+
+
+// ------------------------------------------------------------------------------------------
+// selector channels
+
+static void cps_channel_pub(cps_channel_t *ch, cps_msg_t *msg);
+
+static int cps_trie_cmp(struct cps_trie_node *a, struct cps_trie_node *b) {
+	int cmp = memcmp(a->segment, b->segment, a->seglen < b->seglen ? a->seglen : b->seglen);
+	if (cmp != 0)
+		return cmp;
+	return a->seglen < b->seglen ? -1 : a->seglen > b->seglen;
+}
+RB_GENERATE(cps_trie, cps_trie_node, entry, cps_trie_cmp);
+
+
+static struct cps_trie_node *cps_trie_node_new(struct cps_trie_node *parent, const char *segment, size_t seglen) {
+	struct cps_trie_node *node;
+	if (!(node = calloc(1, sizeof(struct cps_trie_node) + seglen + 1)))
+		return NULL;
+	node->segment = memcpy((char *)(node + 1), segment, seglen);
+	node->seglen = seglen;
+	node->parent = parent;
+	RB_INIT(&node->children);
+	TAILQ_INIT(&node->exact);
+	TAILQ_INIT(&node->rest);
+	return node;
+}
+
+
+static struct cps_trie_node *cps_trie_child(struct cps_trie_node *node, const char *segment, size_t seglen,
+	bool create)
+{
+	struct cps_trie_node key, *child;
+	key.segment = (char *)segment;
+	key.seglen = seglen;
+	if ((child = RB_FIND(cps_trie, &node->children, &key)) || !create)
+		return child;
+	if ((child = cps_trie_node_new(node, segment, seglen)))
+		RB_INSERT(cps_trie, &node->children, child);
+	return child;
+}
+
+
+// Adds <link> for <pattern> (a channel name, possibly with "*" segments) to
+// the trie of <server>.
+static int cps_trie_add(cps_server_t *server, struct cps_chlink *link, const char *pattern) {
+	struct cps_trie_node *node;
+	const char *p = pattern, *end = pattern + strlen(pattern), *q;
+	
+	if (!server->trie && !(server->trie = cps_trie_node_new(NULL, "", 0)))
+		return -1;
+	node = server->trie;
+	for (; p <= end; p = q + 1) {
+		if (!(q = memchr(p, '.', end - p)))
+			q = end;
+		if (q == end && q - p == 1 && *p == '*') {
+			link->rest = true;
+			break;
+		}
+		if (!(node = cps_trie_child(node, p, q - p, true)))
+			return -1;
+	}
+	link->node = node;
+	TAILQ_INSERT_TAIL(link->rest ? &node->rest : &node->exact, link, next);
+	return 0;
+}
+
+
+// Removes <link> from its trie node, and then every node left without links
+// or children.
+static void cps_trie_remove(cps_server_t *server, struct cps_chlink *link) {
+	struct cps_trie_node *node = link->node, *parent;
+	
+	TAILQ_REMOVE(link->rest ? &node->rest : &node->exact, link, next);
+	while (node && TAILQ_EMPTY(&node->exact) && TAILQ_EMPTY(&node->rest) && RB_EMPTY(&node->children)) {
+		if ((parent = node->parent))
+			RB_REMOVE(cps_trie, &parent->children, node);
+		else
+			server->trie = NULL;
+		free(node);
+		node = parent;
+	}
+}
+
+
+// Hands <msg> to every selector channel listening to the segments of a channel
+// name from <p> on. A selector channel matching through several names or
+// patterns gets the message once.
+static void cps_trie_match(struct cps_trie_node *node, const char *p, const char *end, cps_msg_t *msg) {
+	struct cps_trie_node *child;
+	struct cps_chlink *link;
+	const char *q;
+	
+	if (p > end) {
+		TAILQ_FOREACH(link, &node->exact, next) {
+			if (link->channel->last_seq != msg->seq)
+				cps_channel_pub(link->channel, msg);
+		}
+		return;
+	}
+	TAILQ_FOREACH(link, &node->rest, next) {
+		if (link->channel->last_seq != msg->seq)
+			cps_channel_pub(link->channel, msg);
+	}
+	if (!(q = memchr(p, '.', end - p)))
+		q = end;
+	if ((child = cps_trie_child(node, p, q - p, false)))
+		cps_trie_match(child, q + 1, end, msg);
+	if ((child = cps_trie_child(node, "*", 1, false)))
+		cps_trie_match(child, q + 1, end, msg);
+}
+
+
+// Counts a finished fan-out to <count> subscribers which took <usec>.
+static void cps_stats_fanout(struct cps_stats *stats, int count, unsigned long usec) {
+	int i;
+	for (i = 0; i < FANOUT_BUCKETS && usec > cps_fanout_buckets[i]; i++)
+		;
+	stats->fanout_hist[i]++;
+	stats->fanouts++;
+	stats->fanout_usec += usec;
+	stats->deliveries += count;
+}
+
+
+static void cps_fanout_free(cps_channel_t *ch, struct cps_fanout *fanout) {
+	cps_body_t *body, *nextbody;
+	for (body = RB_MIN(cps_bodies, &fanout->bodies); body; body = nextbody) {
+		nextbody = RB_NEXT(cps_bodies, &fanout->bodies, body);
+		RB_REMOVE(cps_bodies, &fanout->bodies, body);
+		cps_body_release(body);
+	}
+	cps_msg_release(fanout->msg);
+	slab_free(&ch->server->worker->fanouts, fanout);
+}
+
+
+// Sends the pending messages of <ch> to its subscribers, in order, until
+// <budget> subscribers have been sent to. Returns true once all of them are.
+static bool cps_channel_fanout(cps_channel_t *ch, int *budget) {
+	struct cps_fanout *fanout;
+	cps_sub_t *sub;
+	cps_body_t *body;
+	
+	while ((fanout = TAILQ_FIRST(&ch->fanouts))) {
+		while ((sub = ch->cursor) && *budget > 0) {
+			ch->cursor = TAILQ_NEXT(sub, next);
+			// subscribed after the message was published, and caught up on it if asked to
+			if (sub->mark >= fanout->mark)
+				continue;
+			(*budget)--;
+			fanout->count++;
+			if (sub->batch && !sub->stream) {
+				cps_sub_hold(sub, fanout->msg);
+				continue;
+			}
+			if (!(body = cps_body_get(ch->server->worker, &fanout->bodies, sub->format, sub->jsonp,
+				fanout->msg, ch->selector, sub->encoding, ch->server->compress_min_size)))
+			{
+				cps_sub_log_err(sub, "failed to allocate message body");
+				continue;
+			}
+			// may unlink <sub>, which is why the cursor has moved on already
+			cps_sub_pub(sub, body);
+		}
+		if (sub)
+			return false;
+		cps_channel_log_debug(ch, "published %llu bytes to %d subscribers",
+			(unsigned long long)fanout->msg->length, fanout->count);
+		cps_stats_fanout(&ch->stats, fanout->count, cps_now_usec() - fanout->start);
+		TAILQ_REMOVE(&ch->fanouts, fanout, next);
+		cps_fanout_free(ch, fanout);
+		ch->cursor = TAILQ_FIRST(&ch->subs);
+	}
+	return true;
+}
+
+
+// Gives each channel with fanouts left a turn, until FANOUT_SLICE subscribers
+// have been sent to, and comes back after the event loop has handled whatever
+// else is pending.
+static void _cps_worker_fanout_cb(int fd, short what, void *_worker) {
+	cps_worker_t *worker = (cps_worker_t *)_worker;
+	struct timeval now = { 0, 0 };
+	int budget = FANOUT_SLICE;
+	cps_channel_t *ch;
+	
+	while (budget > 0 && (ch = TAILQ_FIRST(&worker->busy))) {
+		TAILQ_REMOVE(&worker->busy, ch, busy_next);
+		if (cps_channel_fanout(ch, &budget))
+			ch->busy = false;
+		else
+			TAILQ_INSERT_TAIL(&worker->busy, ch, busy_next);
+	}
+	if (!TAILQ_EMPTY(&worker->busy))
+		event_add(&worker->fanout_ev, &now);
+}
+
+
+// Adds <msg> to the history of <ch> and starts sending it to the subscribers.
+// While earlier messages are still being sent, it waits for them. Otherwise,
+// up to FANOUT_SLICE subscribers are sent to right away, and the rest (if
+// any) in later turns.
+static void cps_channel_send(cps_channel_t *ch, cps_msg_t *msg) {
+	cps_worker_t *worker = ch->server->worker;
+	struct timeval now = { 0, 0 };
+	struct cps_fanout *fanout;
+	int budget = FANOUT_SLICE;
+	
+	cps_channel_log_info(ch, "publishing %llu bytes", (unsigned long long)msg->length);
+	cps_history_add(&ch->history, msg);
+	if (ch->own_log && msglog_append(ch->log, msg->seq, msg->data, msg->length) != 0)
+		cps_channel_log_err(ch, "failed to write message %llu to log: %s", (unsigned long long)msg->seq, strerror(errno));
+	ch->published++;
+	ch->stats.sent++;
+	// a selector channel is kept alive by its subscribers only
+	if (ch->selector)
+		ch->last_seq = msg->seq;
+	else
+		cps_channel_touch(ch);
+	
+	if (!(fanout = slab_alloc(&worker->fanouts))) {
+		cps_channel_log_err(ch, "failed to allocate fanout");
+	}
+	else {
+		cps_msg_retain(msg);
+		fanout->msg = msg;
+		fanout->mark = ch->published;
+		fanout->count = 0;
+		fanout->start = cps_now_usec();
+		RB_INIT(&fanout->bodies);
+		if (TAILQ_EMPTY(&ch->fanouts))
+			ch->cursor = TAILQ_FIRST(&ch->subs);
+		TAILQ_INSERT_TAIL(&ch->fanouts, fanout, next);
+		if (!ch->busy && !cps_channel_fanout(ch, &budget)) {
+			ch->busy = true;
+			TAILQ_INSERT_TAIL(&worker->busy, ch, busy_next);
+			event_add(&worker->fanout_ev, &now);
+		}
+	}
+	
+	if (!ch->selector && ch->server->trie)
+		cps_trie_match(ch->server->trie, msg->channel, msg->channel + strlen(msg->channel), msg);
+}
+
+
+static int cps_latest_cmp(struct cps_latest *a, struct cps_latest *b) {
+	return strcmp(a->msg->key ? a->msg->key : "", b->msg->key ? b->msg->key : "");
+}
+RB_GENERATE(cps_latest_keys, cps_latest, entry, cps_latest_cmp);
+
+
+// Sends the messages held back for the conflation window, in the order their
+// keys came in.
+static void cps_channel_latest_send(cps_channel_t *ch) {
+	struct cps_latest *latest;
+	while ((latest = TAILQ_FIRST(&ch->latest_order))) {
+		TAILQ_REMOVE(&ch->latest_order, latest, next);
+		RB_REMOVE(cps_latest_keys, &ch->latest, latest);
+		cps_channel_send(ch, latest->msg);
+		cps_msg_release(latest->msg);
+		free(latest);
+	}
+}
+
+
+// Ends the conflation window of a channel by sending the latest message of
+// each key, in the order they came in, and opens the next window if there
+// were any.
+static void _cps_channel_conflate_cb(int fd, short what, void *_channel) {
+	cps_channel_t *ch = (cps_channel_t *)_channel;
+	struct timeval window = { ch->conflate / 1000, (ch->conflate % 1000) * 1000 };
+	
+	if (TAILQ_EMPTY(&ch->latest_order)) {
+		ch->conflating = false;
+		return;
+	}
+	cps_channel_latest_send(ch);
+	event_add(&ch->conflate_ev, &window);
+}
+
+
+// Changes the conflation window of <ch>. A window which is open is ended right
+// away, so that nothing held back waits for a window of the old length.
+static void cps_channel_set_conflate(cps_channel_t *ch, int conflate) {
+	if (conflate == ch->conflate)
+		return;
+	ch->conflate = conflate;
+	if (!ch->conflating)
+		return;
+	event_del(&ch->conflate_ev);
+	ch->conflating = false;
+	cps_channel_latest_send(ch);
+}
+
+
+static void cps_channel_latest_clear(cps_channel_t *ch) {
+	struct cps_latest *latest;
+	while ((latest = TAILQ_FIRST(&ch->latest_order))) {
+		TAILQ_REMOVE(&ch->latest_order, latest, next);
+		RB_REMOVE(cps_latest_keys, &ch->latest, latest);
+		cps_msg_release(latest->msg);
+		free(latest);
+	}
+}
+
+
+// Publishes <msg> to the subscribers of <ch>. A conflating channel sends the
+// first message right away and then opens a window of <conflate> ms, during
+// which a newer message replaces an older one with the same key instead of
+// being sent as well.
+static void cps_channel_pub(cps_channel_t *ch, cps_msg_t *msg) {
+	struct timeval window = { ch->conflate / 1000, (ch->conflate % 1000) * 1000 };
+	struct cps_latest key, *latest;
+	
+	ch->stats.publishes++;
+	ch->stats.bytes_in += msg->length;
+	if (ch->conflate <= 0) {
+		cps_channel_send(ch, msg);
+		return;
+	}
+	if (!ch->conflating) {
+		ch->conflating = true;
+		event_add(&ch->conflate_ev, &window);
+		cps_channel_send(ch, msg);
+		return;
+	}
+	
+	cps_msg_retain(msg);
+	key.msg = msg;
+	if ((latest = RB_FIND(cps_latest_keys, &ch->latest, &key))) {
+		// the newest message goes out, in the place of the newest key
+		cps_msg_release(latest->msg);
+		latest->msg = msg;
+		TAILQ_REMOVE(&ch->latest_order, latest, next);
+		TAILQ_INSERT_TAIL(&ch->latest_order, latest, next);
+		ch->stats.conflated++;
+		return;
+	}
+	if (!(latest = malloc(sizeof(struct cps_latest)))) {
+		cps_channel_log_err(ch, "failed to hold back message");
+		cps_msg_release(msg);
+		return;
+	}
+	latest->msg = msg;
+	RB_INSERT(cps_latest_keys, &ch->latest, latest);
+	TAILQ_INSERT_TAIL(&ch->latest_order, latest, next);
+}
+
+
+// Publishes <data> to <ch> by handing it to the sequencer of its server,
+// which hands it to every worker, this one included. <blob>, if not NULL,
+// holds <data> and is referenced rather than copied. On conflating channels,
+// <key> (if not NULL) names what the message is the latest value of.
+// Returns 0, or the HTTP status to answer with: 500 if the message could not
+// be allocated, 503 once the server is handing over to an upgraded process
+// (which numbers messages from the sequencer's <limit> on).
+static int cps_channel_publish(cps_channel_t *ch, const char *sender, const char *key, const char *data,
+	size_t length, cps_blob_t *blob)
+{
+	cps_server_t *server = ch->server;
+	cps_msg_t *msg;
+	if (server->drain_until || cps_sequencer_full(server->sequencer))
+		return 503;
+	if (!(msg = cps_msg_new(ch, sender, key, data, length, blob))) {
+		cps_channel_log_err(ch, "failed to allocate message");
+		return 500;
+	}
+	cps_sequencer_push(server->sequencer, msg);
+	return 0;
+}
+
+
+// Returns 0 if <key> grants publishing to <ch>, otherwise the HTTP status to
+// answer with: 400 if the key is missing, 401 if it does not match.
+static int cps_channel_authorize(cps_channel_t *ch, const char *key) {
+	if (!ch->pubkey || !strlen(ch->pubkey))
+		return 0;
+	if (key == NULL)
+		return 400;
+	return strcmp(key, ch->pubkey) == 0 ? 0 : 401;
+}
+
+// ------------------------------------------------------------------------------------------
+// websockets
+
+static bool cps_ws_is_upgrade(struct evhttp_request *req) {
+	const char *value = evhttp_find_header(req->input_headers, "Upgrade");
+	return value && strcasecmp(value, "websocket") == 0;
+}
+
+
+static void cps_ws_send(cps_sub_t *sub, int opcode, const void *data, size_t length) {
+	uint8_t head[10];
+	struct evbuffer *buf = bufferevent_get_output(sub->ws);
+	evbuffer_add(buf, head, cps_ws_frame_header(head, opcode, length));
+	evbuffer_add(buf, data, length);
+}
+
+
+static void cps_ws_close(cps_sub_t *sub) {
+	struct evhttp_connection *evcon = sub->req->evcon;
+	cps_sub_log_info(sub, "disconnected");
+	if (sub->ws_frag)
+		evbuffer_free(sub->ws_frag);
+	cps_sub_delete(sub);
+	// also frees the bufferevent we took over
+	evhttp_connection_free(evcon);
+}
+
+
+// Sends a close frame with <status> and closes the connection once it has
+// been written.
+static void cps_ws_shutdown(cps_sub_t *sub, int status) {
+	uint8_t code[2] = { (uint8_t)(status >> 8), (uint8_t)status };
+	if (sub->ws_closing)
+		return;
+	cps_sub_flush(sub);
+	sub->ws_closing = true;
+	bufferevent_disable(sub->ws, EV_READ);
+	cps_ws_send(sub, 0x8, code, sizeof(code));
+}
+
+
+static void _cps_ws_write_cb(struct bufferevent *bev, void *_sub) {
+	cps_sub_t *sub = (cps_sub_t *)_sub;
+	if (sub->ws_closing)
+		cps_ws_close(sub);
+	else
+		cps_sub_flush(sub);
+}
+
+
+static void _cps_ws_event_cb(struct bufferevent *bev, short what, void *_sub) {
+	cps_ws_close((cps_sub_t *)_sub);
+}
+
+
+// Reads frames sent by a WebSocket client. Text and binary messages are
+// published to the channel through the same path as a POST.
+static void _cps_ws_read_cb(struct bufferevent *bev, void *_sub) {
+	cps_sub_t *sub = (cps_sub_t *)_sub;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	uint8_t *p, mask[4];
+	uint64_t length;
+	size_t avail, off;
+	int opcode, i;
+	bool fin;
+	
+	while (!sub->ws_closing && (avail = evbuffer_get_length(input)) >= 2) {
+		p = evbuffer_pullup(input, avail < 14 ? avail : 14);
+		fin = p[0] & 0x80;
+		opcode = p[0] & 0x0f;
+		length = p[1] & 0x7f;
+		off = 2;
+		if (length == 126) {
+			if (avail < 4)
+				return;
+			length = (uint64_t)p[2] << 8 | p[3];
+			off = 4;
+		}
+		else if (length == 127) {
+			if (avail < 10)
+				return;
+			for (length = 0, i = 0; i < 8; i++)
+				length = length << 8 | p[2 + i];
+			off = 10;
+		}
+		if (!(p[1] & 0x80)) {
+			cps_sub_log_warn(sub, "unmasked websocket frame");
+			cps_ws_shutdown(sub, 1002);
+			return;
+		}
+		if (length > MAX_CLIENT_BUFSIZ) {
+			cps_sub_log_warn(sub, "websocket frame too large (%llu)", (unsigned long long)length);
+			cps_ws_shutdown(sub, 1009);
+			return;
+		}
+		if (avail < off + 4 + length)
+			return;
+		memcpy(mask, p + off, 4);
+		evbuffer_drain(input, off + 4);
+		p = evbuffer_pullup(input, length);
+		for (i = 0; i < length; i++)
+			p[i] ^= mask[i & 3];
+		
+		switch (opcode) {
+		case 0x0: // continuation
+		case 0x1: // text
+		case 0x2: // binary
+			if (!sub->ws_publisher) {
+				cps_sub_log_warn(sub, "bad pubkey -- not allowed to publish");
+				cps_ws_shutdown(sub, 1008);
+				break;
+			}
+			if (!fin || sub->ws_frag) {
+				if (!sub->ws_frag)
+					sub->ws_frag = evbuffer_new();
+				evbuffer_add(sub->ws_frag, p, length);
+				if (EVBUFFER_LENGTH(sub->ws_frag) > MAX_CLIENT_BUFSIZ) {
+					cps_ws_shutdown(sub, 1009);
+					break;
+				}
+				if (!fin)
+					break;
+				char sender[128];
+				cps_channel_publish(sub->channel, _evhttp_peername(sub->req->evcon, sender, sizeof(sender)), NULL,
+					(const char *)EVBUFFER_DATA(sub->ws_frag), EVBUFFER_LENGTH(sub->ws_frag), NULL);
+				evbuffer_free(sub->ws_frag);
+				sub->ws_frag = NULL;
+			}
+			else {
+				char sender[128];
+				cps_channel_publish(sub->channel, _evhttp_peername(sub->req->evcon, sender, sizeof(sender)), NULL,
+					(const char *)p, length, NULL);
+			}
+			break;
+		case 0x8: // close
+			cps_ws_shutdown(sub, length >= 2 ? (p[0] << 8 | p[1]) : 1000);
+			break;
+		case 0x9: // ping
+			cps_ws_send(sub, 0xA, p, length);
+			break;
+		case 0xA: // pong
+			break;
+		default:
+			cps_ws_shutdown(sub, 1002);
+			break;
+		}
+		evbuffer_drain(input, length);
+	}
+}
+
+
+// Completes the WebSocket handshake for <req> and takes over its connection
+// from evhttp. The subscriber then receives every message as a frame, and
+// may publish by sending frames if it presented the channel's publish key
+// (in the X-CPS-Publish-Key header, or as ?publish_key= since browsers can
+// not set headers on WebSockets).
+static cps_sub_t *cps_ws_open(cps_channel_t *ch, struct evhttp_request *req) {
+	const char *key = evhttp_find_header(req->input_headers, "Sec-WebSocket-Key");
+	const char *pubkey = evhttp_find_header(req->input_headers, "X-CPS-Publish-Key");
+	cps_worker_t *worker = ch->server->worker;
+	cps_query_t *query;
+	uint8_t digest[SHA1_DIGEST_LENGTH];
+	char accept[32];
+	cps_sub_t *sub;
+	sha1_t sha1;
+	
+	if (key == NULL) {
+		cps_channel_log_warn(ch, "websocket upgrade without key from %s:%d", req->remote_host, req->remote_port);
+		evhttp_send_reply(req, 400, "Bad Request", NULL);
+		return NULL;
+	}
+	if (!(sub = slab_calloc(&worker->subs))) {
+		cps_channel_log_err(ch, "failed to allocate subscriber for %s:%d", req->remote_host, req->remote_port);
+		cps_channel_refuse(ch, req);
+		return NULL;
+	}
+	sub->req = req;
+	sub->channel = ch;
+	TAILQ_INIT(&sub->queue);
+	query = cps_query_parse(worker, req->uri);
+	cps_sub_parse_query(sub, query);
+	sub->format = CPS_FORMAT_WS;
+	sub->stream = true;
+	sub->jsonp[0] = '\0';
+	
+	if (!pubkey)
+		pubkey = cps_query_get(query, "publish_key");
+	sub->ws_publisher = !ch->selector && cps_channel_authorize(ch, pubkey) == 0;
+	cps_query_free(worker, query);
+	
+	sha1_init(&sha1);
+	sha1_update(&sha1, key, strlen(key));
+	sha1_update(&sha1, WS_GUID, strlen(WS_GUID));
+	sha1_final(&sha1, digest);
+	base64_encode(accept, digest, sizeof(digest));
+	
+	// from here on, the connection is ours
+	sub->ws = evhttp_connection_get_bufferevent(req->evcon);
+	bufferevent_setcb(sub->ws, _cps_ws_read_cb, _cps_ws_write_cb, _cps_ws_event_cb, sub);
+	bufferevent_set_timeouts(sub->ws, NULL, NULL);
+	bufferevent_enable(sub->ws, EV_READ|EV_WRITE);
+	evbuffer_add_printf(bufferevent_get_output(sub->ws),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+	
+	if (sub->has_since)
+		cps_sub_catchup(sub);
+	cps_channel_attach(ch, sub);
+	cps_sub_log_info(sub, "websocket open%s", sub->ws_publisher ? " (publisher)" : "");
+	return sub;
+}
+
+
+// Ends a subscription without a message: long-polling subscribers get an
+// empty 204 response, streams are ended and WebSockets are sent a close frame.
+static void cps_sub_close(cps_sub_t *sub, int ws_status) {
+	struct evhttp_request *req = sub->req;
+	if (sub->ws) {
+		cps_ws_shutdown(sub, ws_status);
+	}
+	else if (sub->stream) {
+		cps_sub_flush(sub);
+		cps_sub_delete(sub);
+		evhttp_send_reply_end(req);
+	}
+	else if (!TAILQ_EMPTY(&sub->queue)) {
+		cps_sub_send_batch(sub);
+	}
+	else {
+		cps_sub_delete(sub);
+		evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+	}
+}
+
+
+void cps_channel_request_handler(struct evhttp_request *req, void *_channel) {
+	cps_channel_t *ch = (cps_channel_t *)_channel;
+	//cps_server_t *server = (cps_server_t *)_server;
+	switch (req->type) {
+	case EVHTTP_REQ_GET: {
+		cps_channel_log_debug(ch, "GET %s from %s:%d", req->uri, req->remote_host, req->remote_port);
+		if (!cps_channel_admit(ch, req))
+			break;
+		ch->stats.subscribes++;
+		if (cps_ws_is_upgrade(req))
+			cps_ws_open(ch, req);
+		else
+			cps_sub_open(ch, req);
+		break;
+	}
+	case EVHTTP_REQ_POST: {
+		cps_channel_log_debug(ch, "POST %s from %s:%d", req->uri, req->remote_host, req->remote_port);
+		// publish-key
+		switch (cps_channel_authorize(ch, evhttp_find_header(req->input_headers, "X-CPS-Publish-Key"))) {
+		case 400:
+			cps_channel_log_warn(ch, "bad pubkey (missing) from %s:%d", req->remote_host, req->remote_port);
+			evhttp_send_reply(req, 400, "Bad Request", NULL);
+			return;
+		case 401:
+			cps_channel_log_warn(ch, "bad pubkey (mismatch) from %s:%d", req->remote_host, req->remote_port);
+			evhttp_send_reply(req, 401, "Unauthorized", NULL);
+			return;
+		}
+		// publish, on every worker in the same order
+		char sender[128], retry_after[16];
+		_evhttp_peername(req->evcon, sender, sizeof(sender));
+		switch (cps_channel_publish(ch, sender, evhttp_find_header(req->input_headers, "X-CPS-Conflate-Key"),
+			(const char *)EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer), NULL))
+		{
+		case 500:
+			evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+			return;
+		case 503:
+			// the connection is closed, so the publisher retries with the new process
+			snprintf(retry_after, sizeof(retry_after), "%d", ch->server->retry_after);
+			evhttp_add_header(req->output_headers, "Retry-After", retry_after);
+			evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+			return;
+		}
+		// empty OK reply
+		evhttp_send_reply(req, HTTP_NOCONTENT, "OK", NULL);
+		break;
+	}
+	default:
+		cps_channel_log_warn(ch, "bad request method from %s:%d", req->remote_host, req->remote_port);
+		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+		break;
+	}
+}
+
+// Parses the next record of a batch at <*p>, which is a header line
+// "<channel>[,<channel>...] <length>\n" followed by <length> bytes of payload
+// and optionally a newline. Returns 1 and advances <*p> past the record, 0 at
+// the end of the batch, or -1 if the record is malformed.
+static int _cps_batch_next(const char **p, const char *end, const char **channels, size_t *chlen,
+	const char **payload, size_t *length)
+{
+	const char *eol, *digits_end, *sp, *q;
+	
+	while (*p < end && (**p == '\n' || **p == '\r'))
+		(*p)++;
+	if (*p == end)
+		return 0;
+	if (!(eol = memchr(*p, '\n', end - *p)))
+		return -1;
+	// the line may end in "\r\n"; any other '\r' is not a digit
+	digits_end = eol > *p && eol[-1] == '\r' ? eol - 1 : eol;
+	for (sp = digits_end; sp > *p && sp[-1] != ' '; sp--)
+		;
+	if (sp <= *p + 1 || sp == digits_end)
+		return -1;
+	*length = 0;
+	for (q = sp; q < digits_end; q++) {
+		if (*q < '0' || *q > '9' || *length > MAX_CLIENT_BUFSIZ)
+			return -1;
+		*length = *length * 10 + (*q - '0');
+	}
+	*channels = *p;
+	*chlen = sp - 1 - *p;
+	*payload = eol + 1;
+	if (*length > (size_t)(end - *payload))
+		return -1;
+	*p = *payload + *length;
+	return 1;
+}
+
+
+// Publishes every record of a batch POST. The request body is copied once into
+// a blob which all of the messages reference. A request presenting the
+// server's publish_key may publish to any channel; otherwise each channel
+// checks the presented key as it would for a single POST, and records for
+// channels which refuse it (or do not exist) are counted as rejected. A
+// malformed body is refused as a whole, before anything is published.
+static void cps_server_publish_batch(cps_server_t *server, struct evhttp_request *req) {
+	const char *key = evhttp_find_header(req->input_headers, "X-CPS-Publish-Key");
+	const char *p, *end, *channels, *payload, *name, *comma;
+	char chname[MAX_CHANNEL_NAME + 1], sender[128], retry_after[16];
+	size_t chlen, length, namelen;
+	int published = 0, rejected = 0, rc;
+	bool authorized = false;
+	struct evbuffer *reply;
+	cps_channel_t *ch;
+	cps_blob_t *blob;
+	
+	if (req->type != EVHTTP_REQ_POST) {
+		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+		return;
+	}
+	if (server->drain_until) {
+		snprintf(retry_after, sizeof(retry_after), "%d", server->retry_after);
+		evhttp_add_header(req->output_headers, "Retry-After", retry_after);
+		evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+		return;
+	}
+	if (server->pubkey) {
+		if (!key || strcmp(key, server->pubkey) != 0) {
+			cps_server_log_warn(server, "bad batch pubkey (%s) from %s:%d", key ? "mismatch" : "missing",
+				req->remote_host, req->remote_port);
+			evhttp_send_reply(req, key ? 401 : 400, key ? "Unauthorized" : "Bad Request", NULL);
+			return;
+		}
+		authorized = true;
+	}
+	if (!(blob = cps_blob_new(req->input_buffer, EVBUFFER_LENGTH(req->input_buffer)))) {
+		evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+		return;
+	}
+	end = blob->data + blob->length;
+	
+	for (p = blob->data; (rc = _cps_batch_next(&p, end, &channels, &chlen, &payload, &length)) == 1; )
+		;
+	if (rc == -1) {
+		cps_server_log_warn(server, "malformed batch from %s:%d at byte %zu",
+			req->remote_host, req->remote_port, (size_t)(p - blob->data));
+		cps_blob_release(blob);
+		evhttp_send_reply(req, 400, "Bad Request", NULL);
+		return;
+	}
+	
+	_evhttp_peername(req->evcon, sender, sizeof(sender));
+	for (p = blob->data; _cps_batch_next(&p, end, &channels, &chlen, &payload, &length) == 1; ) {
+		for (name = channels; name < channels + chlen; name = comma + 1) {
+			if (!(comma = memchr(name, ',', channels + chlen - name)))
+				comma = channels + chlen;
+			namelen = comma - name;
+			if (namelen == 0 || namelen > MAX_CHANNEL_NAME) {
+				rejected++;
+				continue;
+			}
+			memcpy(chname, name, namelen);
+			chname[namelen] = '\0';
+			if (!(ch = cps_channel_find(server, chname)) && server->dynamic.enabled)
+				ch = cps_channel_open_dynamic(server, chname);
+			if (!ch || ch->selector || (!authorized && cps_channel_authorize(ch, key) != 0)
+				|| cps_channel_publish(ch, sender, NULL, payload, length, blob) != 0)
+			{
+				rejected++;
+				continue;
+			}
+			published++;
+		}
+	}
+	cps_blob_release(blob);
+	
+	cps_server_log_debug(server, "batch from %s:%d: %d published, %d rejected",
+		req->remote_host, req->remote_port, published, rejected);
+	reply = evbuffer_new();
+	evbuffer_add_printf(reply, "{\"published\": %d, \"rejected\": %d}\n", published, rejected);
+	evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+	evhttp_send_reply(req, 200, "OK", reply);
+	evbuffer_free(reply);
+}
+
+// ------------------------------------------------------------------------------------------
+// statistics
+
+// The counters of struct cps_stats, as reported by /_stats. Those counting
+// what happens to published messages before they are sent are the same on
+// every worker (each of them gets every message), so the largest is taken
+// rather than the sum.
+static const struct cps_stats_field {
+	const char *name;
+	size_t offset;
+	bool counter;       // only ever grows (otherwise a gauge)
+	bool shared;
+	const char *help;
+} cps_stats_fields[] = {
+	{ "subscribers", offsetof(struct cps_stats, subscribers), false, false, "Connected subscribers." },
+	{ "subscribes", offsetof(struct cps_stats, subscribes), true, false,
+		"Subscribe requests, including long-poll reconnects." },
+	{ "rejected", offsetof(struct cps_stats, rejected), true, false, "Subscribers turned away by max_clients." },
+	{ "publishes", offsetof(struct cps_stats, publishes), true, true, "Messages published." },
+	{ "bytes_in", offsetof(struct cps_stats, bytes_in), true, true, "Payload bytes published." },
+	{ "sent", offsetof(struct cps_stats, sent), true, true, "Messages sent to subscribers, after conflation." },
+	{ "conflated", offsetof(struct cps_stats, conflated), true, true,
+		"Messages replaced by newer ones before being sent." },
+	{ "deliveries", offsetof(struct cps_stats, deliveries), true, false, "Messages handed to subscribers." },
+	{ "bytes_out", offsetof(struct cps_stats, bytes_out), true, false, "Bytes handed to subscriber connections." },
+	{ "evicted", offsetof(struct cps_stats, evicted), true, false, "Slow subscribers disconnected." },
+	{ "dropped", offsetof(struct cps_stats, dropped), true, false, "Messages dropped for slow subscribers." },
+	{ "coalesced", offsetof(struct cps_stats, coalesced), true, false,
+		"Messages replaced by newer ones for slow subscribers." },
+};
+
+#define cps_stats_value(stats, field) (*(unsigned long *)((char *)(stats) + (field)->offset))
+
+static void cps_stats_add(struct cps_stats *total, struct cps_stats *stats) {
+	const struct cps_stats_field *field;
+	int i;
+	for (i = 0; i < sizeof(cps_stats_fields) / sizeof(cps_stats_fields[0]); i++) {
+		field = &cps_stats_fields[i];
+		if (!field->shared)
+			cps_stats_value(total, field) += cps_stats_value(stats, field);
+		else if (cps_stats_value(stats, field) > cps_stats_value(total, field))
+			cps_stats_value(total, field) = cps_stats_value(stats, field);
+	}
+	for (i = 0; i <= FANOUT_BUCKETS; i++)
+		total->fanout_hist[i] += stats->fanout_hist[i];
+	total->fanouts += stats->fanouts;
+	total->fanout_usec += stats->fanout_usec;
+}
+
+
+// The counters of one channel, added up over the workers.
+struct cps_stats_entry {
+	const char *name;
+	struct cps_stats stats;
+	RB_ENTRY(cps_stats_entry) entry;
+};
+RB_HEAD(cps_stats_tree, cps_stats_entry);
+
+static int cps_stats_entry_cmp(struct cps_stats_entry *a, struct cps_stats_entry *b) {
+	return strcmp(a->name, b->name);
+}
+RB_GENERATE(cps_stats_tree, cps_stats_entry, entry, cps_stats_entry_cmp);
+
+
+// A stats request on its way through the workers. Each worker adds up the
+// counters of its replica of the server and hands the request on to the next
+// one through its inbox, so only one thread at a time touches it and none of
+// them looks at another's channels. The last one hands it back to the worker
+// which got the request, to answer it. Only that worker looks at the request.
+struct cps_stats_gather {
+	struct evhttp_request *req;     // NULL once the client went away
+	cps_worker_t *origin;
+	int server_id;
+	bool prometheus;
+	int visited;                    // workers so far
+	unsigned long rejected;         // by max_connections
+	struct {
+		const char *name;
+		size_t inuse, allocated, highwater;
+	} pools[WORKER_POOLS];
+	struct cps_stats_tree channels;
+};
+
+
+static void cps_worker_pools(cps_worker_t *worker, slab_t *pools[WORKER_POOLS]) {
+	pools[0] = &worker->subs;
+	pools[1] = &worker->bodies;
+	pools[2] = &worker->queries;
+	pools[3] = &worker->qents;
+	pools[4] = &worker->fanouts;
+}
+
+
+static void cps_stats_render_json(struct evbuffer *buf, cps_server_t *server, struct cps_stats_gather *gather) {
+	struct cps_stats_entry *entry;
+	int i;
+	
+	evbuffer_add_printf(buf, "{\"server\": \"%s\", \"workers\": %d, \"subscribers\": %d, \"rejected\": %lu,"
+		" \"log_dropped\": %lu,\n \"pools\": {", server->name, g_nworkers,
+		__atomic_load_n(server->connections, __ATOMIC_RELAXED), gather->rejected, logring_dropped());
+	for (i = 0; i < WORKER_POOLS; i++) {
+		evbuffer_add_printf(buf, "%s\"%s\": {\"in_use\": %zu, \"allocated\": %zu, \"high_water\": %zu}",
+			i > 0 ? ", " : "", gather->pools[i].name, gather->pools[i].inuse, gather->pools[i].allocated,
+			gather->pools[i].highwater);
+	}
+	evbuffer_add_printf(buf, "},\n \"fanout_buckets_usec\": [");
+	for (i = 0; i < FANOUT_BUCKETS; i++)
+		evbuffer_add_printf(buf, "%s%lu", i > 0 ? ", " : "", cps_fanout_buckets[i]);
+	evbuffer_add_printf(buf, "],\n \"channels\": {");
+	RB_FOREACH(entry, cps_stats_tree, &gather->channels) {
+		evbuffer_add_printf(buf, "%s\n  \"%s\": {", entry == RB_MIN(cps_stats_tree, &gather->channels) ? "" : ",",
+			entry->name);
+		for (i = 0; i < sizeof(cps_stats_fields) / sizeof(cps_stats_fields[0]); i++) {
+			evbuffer_add_printf(buf, "\"%s\": %lu, ", cps_stats_fields[i].name,
+				cps_stats_value(&entry->stats, &cps_stats_fields[i]));
+		}
+		evbuffer_add_printf(buf, "\"fanouts\": %lu, \"fanout_usec\": %lu, \"fanout_buckets\": [",
+			entry->stats.fanouts, entry->stats.fanout_usec);
+		for (i = 0; i <= FANOUT_BUCKETS; i++)
+			evbuffer_add_printf(buf, "%s%lu", i > 0 ? ", " : "", entry->stats.fanout_hist[i]);
+		evbuffer_add_printf(buf, "]}");
+	}
+	evbuffer_add_printf(buf, "}}\n");
+}
+
+
+// Renders the counters in the Prometheus text format, one metric family at a
+// time. Channel names may not contain quotes, backslashes or line breaks, so
+// they need no escaping as label values.
+static void cps_stats_render_prometheus(struct evbuffer *buf, cps_server_t *server,
+	struct cps_stats_gather *gather)
+{
+	static const char *pool_metrics[][2] = {
+		{ "in_use", "Objects in use." },
+		{ "allocated", "Objects allocated." },
+		{ "high_water", "Most objects in use at once." },
+	};
+	const struct cps_stats_field *field;
+	struct cps_stats_entry *entry;
+	unsigned long count;
+	size_t value;
+	int i, j;
+	
+	evbuffer_add_printf(buf, "# HELP cometpsd_subscribers Connected subscribers.\n"
+		"# TYPE cometpsd_subscribers gauge\ncometpsd_subscribers{server=\"%s\"} %d\n", server->name,
+		__atomic_load_n(server->connections, __ATOMIC_RELAXED));
+	evbuffer_add_printf(buf, "# HELP cometpsd_rejected_total Subscribers turned away by max_connections.\n"
+		"# TYPE cometpsd_rejected_total counter\ncometpsd_rejected_total{server=\"%s\"} %lu\n", server->name,
+		gather->rejected);
+	evbuffer_add_printf(buf, "# HELP cometpsd_log_dropped_total Log lines dropped for want of room in the log ring.\n"
+		"# TYPE cometpsd_log_dropped_total counter\ncometpsd_log_dropped_total %lu\n", logring_dropped());
+	for (i = 0; i < sizeof(pool_metrics) / sizeof(pool_metrics[0]); i++) {
+		evbuffer_add_printf(buf, "# HELP cometpsd_pool_%s %s\n# TYPE cometpsd_pool_%s gauge\n",
+			pool_metrics[i][0], pool_metrics[i][1], pool_metrics[i][0]);
+		for (j = 0; j < WORKER_POOLS; j++) {
+			value = i == 0 ? gather->pools[j].inuse : i == 1 ? gather->pools[j].allocated : gather->pools[j].highwater;
+			evbuffer_add_printf(buf, "cometpsd_pool_%s{server=\"%s\",pool=\"%s\"} %zu\n", pool_metrics[i][0],
+				server->name, gather->pools[j].name, value);
+		}
+	}
+	for (i = 0; i < sizeof(cps_stats_fields) / sizeof(cps_stats_fields[0]); i++) {
+		field = &cps_stats_fields[i];
+		evbuffer_add_printf(buf, "# HELP cometpsd_channel_%s%s %s\n# TYPE cometpsd_channel_%s%s %s\n",
+			field->name, field->counter ? "_total" : "", field->help,
+			field->name, field->counter ? "_total" : "", field->counter ? "counter" : "gauge");
+		RB_FOREACH(entry, cps_stats_tree, &gather->channels) {
+			evbuffer_add_printf(buf, "cometpsd_channel_%s%s{server=\"%s\",channel=\"%s\"} %lu\n",
+				field->name, field->counter ? "_total" : "", server->name, entry->name,
+				cps_stats_value(&entry->stats, field));
+		}
+	}
+	evbuffer_add_printf(buf, "# HELP cometpsd_channel_fanout_seconds Time taken to send a message to every"
+		" subscriber.\n# TYPE cometpsd_channel_fanout_seconds histogram\n");
+	RB_FOREACH(entry, cps_stats_tree, &gather->channels) {
+		for (count = 0, i = 0; i <= FANOUT_BUCKETS; i++) {
+			count += entry->stats.fanout_hist[i];
+			if (i < FANOUT_BUCKETS) {
+				evbuffer_add_printf(buf, "cometpsd_channel_fanout_seconds_bucket{server=\"%s\",channel=\"%s\","
+					"le=\"%g\"} %lu\n", server->name, entry->name, cps_fanout_buckets[i] / 1e6, count);
+			}
+			else {
+				evbuffer_add_printf(buf, "cometpsd_channel_fanout_seconds_bucket{server=\"%s\",channel=\"%s\","
+					"le=\"+Inf\"} %lu\n", server->name, entry->name, count);
+			}
+		}
+		evbuffer_add_printf(buf, "cometpsd_channel_fanout_seconds_sum{server=\"%s\",channel=\"%s\"} %g\n"
+			"cometpsd_channel_fanout_seconds_count{server=\"%s\",channel=\"%s\"} %lu\n",
+			server->name, entry->name, entry->stats.fanout_usec / 1e6,
+			server->name, entry->name, entry->stats.fanouts);
+	}
+}
+
+
+static void cps_stats_gather_free(struct cps_stats_gather *gather) {
+	struct cps_stats_entry *entry, *next;
+	for (entry = RB_MIN(cps_stats_tree, &gather->channels); entry; entry = next) {
+		next = RB_NEXT(cps_stats_tree, &gather->channels, entry);
+		RB_REMOVE(cps_stats_tree, &gather->channels, entry);
+		free(entry);
+	}
+	free(gather);
+}
+
+
+// Called by evhttp on the worker which got the request when its connection
+// goes away while the counters are still being gathered, so that the reply
+// is not sent to a request which is gone. As with subscribers, a request the
+// client dropped is detached from its connection and left to us to free.
+static void _cps_stats_close_cb(struct evhttp_connection *evcon, void *_gather) {
+	struct cps_stats_gather *gather = (struct cps_stats_gather *)_gather;
+	if (gather->req->evcon == NULL)
+		evhttp_request_free(gather->req);
+	gather->req = NULL;
+}
+
+
+static void _cps_stats_reply(cps_worker_t *worker, void *_gather) {
+	struct cps_stats_gather *gather = (struct cps_stats_gather *)_gather;
+	cps_server_t *server = cps_worker_server(worker, gather->server_id);
+	struct evbuffer *buf;
+	
+	if (gather->req && gather->req->evcon)
+		evhttp_connection_set_closecb(gather->req->evcon, NULL, NULL);
+	// a server stopped by a reload meanwhile took the request with it
+	if (!server || !gather->req) {
+		cps_stats_gather_free(gather);
+		return;
+	}
+	buf = evbuffer_new();
+	if (gather->prometheus) {
+		cps_stats_render_prometheus(buf, server, gather);
+		evhttp_add_header(gather->req->output_headers, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+	}
+	else {
+		cps_stats_render_json(buf, server, gather);
+		evhttp_add_header(gather->req->output_headers, "Content-Type", "application/json");
+	}
+	evhttp_add_header(gather->req->output_headers, "Cache-Control", "no-cache");
+	evhttp_send_reply(gather->req, 200, "OK", buf);
+	evbuffer_free(buf);
+	cps_stats_gather_free(gather);
+}
+
+
+// Adds the counters of <worker>'s replica of the server to <gather>, and
+// hands it on.
+static void _cps_stats_visit(cps_worker_t *worker, void *_gather) {
+	struct cps_stats_gather *gather = (struct cps_stats_gather *)_gather;
+	cps_server_t *server = cps_worker_server(worker, gather->server_id);
+	struct cps_stats_entry key, *entry;
+	struct cps_stats stats;
+	slab_t *pools[WORKER_POOLS];
+	cps_channel_t *ch;
+	size_t length;
+	int i;
+	
+	if (server) {
+		gather->rejected += server->rejected;
+		TAILQ_FOREACH(ch, &server->channels, next) {
+			key.name = ch->name;
+			if (!(entry = RB_FIND(cps_stats_tree, &gather->channels, &key))) {
+				length = strlen(ch->name) + 1;
+				if (!(entry = calloc(1, sizeof(struct cps_stats_entry) + length)))
+					continue;
+				entry->name = memcpy((char *)(entry + 1), ch->name, length);
+				RB_INSERT(cps_stats_tree, &gather->channels, entry);
+			}
+			stats = ch->stats;
+			stats.subscribers = ch->nsubs;
+			cps_stats_add(&entry->stats, &stats);
+		}
+	}
+	cps_worker_pools(worker, pools);
+	for (i = 0; i < WORKER_POOLS; i++) {
+		gather->pools[i].name = pools[i]->name;
+		gather->pools[i].inuse += pools[i]->inuse;
+		gather->pools[i].allocated += pools[i]->allocated;
+		gather->pools[i].highwater += pools[i]->highwater;
+	}
+	if (++gather->visited < g_nworkers)
+		cps_worker_call(&g_workers[gather->visited], _cps_stats_visit, gather);
+	else
+		cps_worker_call(gather->origin, _cps_stats_reply, gather);
+}
+
+
+// Answers a request for the server's counters: as JSON, or in the Prometheus
+// text format with ?format=prometheus. The counters of every worker are added
+// up, which takes a turn of each of their event loops.
+static void cps_server_stats(cps_server_t *server, struct evhttp_request *req) {
+	struct cps_stats_gather *gather;
+	cps_query_t *query;
+	const char *format;
+	
+	if (req->type != EVHTTP_REQ_GET) {
+		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+		return;
+	}
+	if (!(gather = calloc(1, sizeof(struct cps_stats_gather)))) {
+		evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+		return;
+	}
+	gather->req = req;
+	gather->origin = server->worker;
+	gather->server_id = server->id;
+	query = cps_query_parse(server->worker, req->uri);
+	gather->prometheus = (format = cps_query_get(query, "format")) && strcmp(format, "prometheus") == 0;
+	cps_query_free(server->worker, query);
+	RB_INIT(&gather->channels);
+	evhttp_connection_set_closecb(req->evcon, _cps_stats_close_cb, gather);
+	cps_worker_call(&g_workers[0], _cps_stats_visit, gather);
+}
+
+
+// Routes requests for <channels_uri><name> to their channel, creating it when
+// the server has dynamic channels. Channels are not registered with evhttp
+// (which matches callbacks one by one), so routing costs a hash lookup no
+// matter how many channels there are. A subscriber to several channels
+// (<name> is a pattern, or a comma-separated list, or there is a ?ch= list)
+// is routed to the selector channel for them.
+void cps_server_request_handler(struct evhttp_request *req, void *_server) {
+	cps_server_t *server = (cps_server_t *)_server;
+	size_t prefixlen = strlen(server->channels_uri), length;
+	char name[MAX_SELECTOR], selector[MAX_SELECTOR];
+	const char *list;
+	cps_query_t *query;
+	cps_channel_t *ch = NULL;
+	int count;
+	
+	// while handing over to an upgraded process, clients reconnect to it
+	if (server->drain_until)
+		evhttp_add_header(req->output_headers, "Connection", "close");
+	length = strcspn(req->uri, "?#");
+	if (length == strlen(server->publish_uri) && strncmp(req->uri, server->publish_uri, length) == 0) {
+		cps_server_publish_batch(server, req);
+		return;
+	}
+	if (length == strlen(server->stats_uri) && strncmp(req->uri, server->stats_uri, length) == 0) {
+		cps_server_stats(server, req);
+		return;
+	}
+	if (strncmp(req->uri, server->channels_uri, prefixlen) == 0) {
+		length = strcspn(req->uri + prefixlen, "?#");
+		if (length > 0 && length < sizeof(name)) {
+			memcpy(name, req->uri + prefixlen, length);
+			name[length] = '\0';
+			query = req->uri[prefixlen + length] == '?' ? cps_query_parse(server->worker, req->uri) : NULL;
+			if ((list = cps_query_get(query, "ch")) && *list && length + strlen(list) + 1 < sizeof(name)) {
+				name[length] = ',';
+				strcpy(name + length + 1, list);
+			}
+			cps_query_free(server->worker, query);
+			if (strpbrk(name, ",*")) {
+				count = cps_selector_normalize(selector, sizeof(selector), name);
+				if (count == 1 && !strchr(selector, '*'))
+					strcpy(name, selector); // a single plain channel after all
+				else if (count > 0 && req->type == EVHTTP_REQ_GET
+					&& !(ch = cps_channel_find(server, selector)))
+				{
+					ch = cps_channel_open_selector(server, selector);
+				}
+			}
+			if (!strpbrk(name, ",*") && strlen(name) <= MAX_CHANNEL_NAME
+				&& !(ch = cps_channel_find(server, name)) && server->dynamic.enabled
+				&& (req->type == EVHTTP_REQ_GET || req->type == EVHTTP_REQ_POST))
+			{
+				ch = cps_channel_open_dynamic(server, name);
+			}
+		}
+	}
+	if (ch) {
+		cps_channel_request_handler(req, ch);
+		return;
+	}
+	cps_server_log_debug(server, "unhandled request (404) for \"%s\" from %s:%d",
+		req->uri, req->remote_host, req->remote_port);
+	evhttp_send_reply(req, 404, "Not Found", NULL);
+}
+
+
+// Creates a listening socket with SO_REUSEPORT set, so that every worker can
+// bind its own socket to the same address and let the kernel spread
+// incoming connections between them.
+static int cps_listen_reuseport(const char *address, int port) {
+	struct addrinfo hints, *ai;
+	char portstr[16];
+	int fd, on = 1;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	if (getaddrinfo(address, portstr, &hints, &ai) != 0)
+		return -1;
+	
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+		freeaddrinfo(ai);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+		|| bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+		|| listen(fd, 128) == -1
+		|| evutil_make_socket_nonblocking(fd) == -1
+		|| evutil_make_socket_closeonexec(fd) == -1)
+	{
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+
+// Returns the replica of server <id> run by <worker>
+static cps_server_t *cps_worker_server(cps_worker_t *worker, int id) {
+	cps_server_t *server;
+	TAILQ_FOREACH(server, &worker->servers, next) {
+		if (server->id == id)
+			return server;
+	}
+	return NULL;
+}
+
+
+// Expires the long-polling subscribers whose timeout is up, answering them with
+// an empty 204 response so they reconnect.
+static void _cps_sub_timeout_cb(twheel_timer_t *timer, void *_server) {
+	cps_sub_t *sub = (cps_sub_t *)((char *)timer - offsetof(cps_sub_t, timer));
+	cps_sub_log_debug(sub, "poll timeout");
+	cps_sub_close(sub, 1000);
+}
+
+
+static void cps_server_log_pools(cps_server_t *server) {
+	slab_t *pools[WORKER_POOLS];
+	int i;
+	cps_worker_pools(server->worker, pools);
+	for (i = 0; i < WORKER_POOLS; i++) {
+		cps_server_log_debug(server, "pool %s: %zu in use, %zu allocated, %zu at most",
+			pools[i]->name, pools[i]->inuse, pools[i]->allocated, pools[i]->highwater);
+	}
+}
+
+
+static void cps_channel_close(cps_channel_t *ch);
+
+// Reclaims a dynamic channel which has had no subscribers and no messages for
+// its idle timeout.
+static void _cps_channel_idle_cb(twheel_timer_t *timer, void *_server) {
+	cps_channel_t *ch = (cps_channel_t *)((char *)timer - offsetof(cps_channel_t, idle_timer));
+	cps_channel_log_debug(ch, "idle -- closing channel");
+	cps_channel_close(ch);
+}
+
+
+// Reports the channels of <server> which had to deal with slow subscribers, or
+// held back messages for conflation.
+static void cps_server_log_overflows(cps_server_t *server) {
+	cps_channel_t *ch;
+	TAILQ_FOREACH(ch, &server->channels, next) {
+		if (ch->stats.evicted || ch->stats.dropped || ch->stats.coalesced) {
+			cps_channel_log_info(ch, "slow subscribers: %lu evicted, %lu messages dropped, %lu coalesced",
+				ch->stats.evicted, ch->stats.dropped, ch->stats.coalesced);
+		}
+		if (ch->stats.conflated)
+			cps_channel_log_info(ch, "%lu messages conflated", ch->stats.conflated);
+	}
+}
+
+
+// Writes out the messages buffered for the logs this replica of <server> keeps
+static void cps_server_flush_logs(cps_server_t *server) {
+	cps_channel_t *ch;
+	TAILQ_FOREACH(ch, &server->logged, log_next) {
+		if (msglog_flush(ch->log) != 0)
+			cps_channel_log_err(ch, "failed to write log: %s", strerror(errno));
+	}
+}
+
+
+static void _cps_server_tick_cb(int fd, short what, void *_server) {
+	cps_server_t *server = (cps_server_t *)_server;
+	// messages are written out in batches, once per tick
+	cps_server_flush_logs(server);
+	twheel_tick(&server->wheel, _cps_sub_timeout_cb, server);
+	twheel_tick(&server->idle_wheel, _cps_channel_idle_cb, server);
+	if (server->wheel.now % (STATS_INTERVAL * 1000 / TIMER_TICK_MS) == 0) {
+		cps_server_log_overflows(server);
+		// the pools belong to the worker, so only its first server reports them
+		if (server == TAILQ_FIRST(&server->worker->servers))
+			cps_server_log_pools(server);
+	}
+}
+
+
+// Starts <worker>'s replica of the server configured by <conf>. Its settings
+// and channels are applied by cps_server_configure.
+cps_server_t *cps_server_start(cps_worker_t *worker, struct cps_server_conf *conf) {
+	cps_server_t *server = calloc(1, sizeof(cps_server_t));
+	const char *address = conf->address;
+	int port = conf->port, fd;
+	uint64_t seq = 0;
+	
+	server->id = conf->id;
+	server->worker = worker;
+	server->log_level = conf->log_level;
+	server->http = evhttp_new(worker->base);
+	
+	if (server->http == NULL) {
+		cps_warn("failed to allocate http server");
+		free(server);
+		return NULL;
+	}
+	
+	// the socket of the process this one is upgrading, if it handed one over
+	if ((fd = cps_upgrade_take(conf->name, worker->id, &seq)) != -1) {
+		if (!(server->bound = evhttp_accept_socket_with_handle(server->http, fd))) {
+			cps_warn("failed to accept on the socket handed over for %s (worker %d)", conf->name, worker->id);
+			close(fd);
+			evhttp_free(server->http);
+			free(server);
+			return NULL;
+		}
+	}
+	else if (g_nworkers > 1) {
+		if ((fd = cps_listen_reuseport(address, port)) == -1
+			|| !(server->bound = evhttp_accept_socket_with_handle(server->http, fd)))
+		{
+			cps_warn("failed to bind http server to %s:%d (worker %d)", address, port, worker->id);
+			if (fd != -1)
+				close(fd);
+			evhttp_free(server->http);
+			free(server);
+			return NULL;
+		}
+	}
+	else if (!(server->bound = evhttp_bind_socket_with_handle(server->http, address, port))) {
+		cps_warn("failed to bind http server to %s:%d", address, port);
+		evhttp_free(server->http);
+		free(server);
+		return NULL;
+	}
+	
+	// replicas share the sequencer and connection counter of the first one started
+	if (!conf->sequencer) {
+		if (!(conf->sequencer = cps_sequencer_new())) {
+			cps_warn("failed to allocate sequencer");
+			evhttp_free(server->http);
+			free(server);
+			return NULL;
+		}
+		conf->connections = calloc(1, sizeof(int));
+	}
+	// carry on numbering messages where the upgraded process left off
+	if (seq)
+		cps_sequencer_raise(conf->sequencer, seq);
+	server->sequencer = conf->sequencer;
+	server->connections = conf->connections;
+	server->name = strdup(conf->name);
+	
+	TAILQ_INIT(&server->channels);
+	TAILQ_INIT(&server->logged);
+	server->nbuckets = MIN_CHANNEL_BUCKETS;
+	server->buckets = calloc(server->nbuckets, sizeof(cps_channel_t *));
+	server->channels_uri = strdup(DEFAULT_CHANNELS_URI);
+	server->publish_uri = strdup(DEFAULT_PUBLISH_URI);
+	server->stats_uri = strdup(DEFAULT_STATS_URI);
+	server->retry_after = DEFAULT_RETRY_AFTER;
+	server->compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+	server->dynamic.history = DEFAULT_HISTORY;
+	server->dynamic.log_level = conf->log_level;
+	server->dynamic.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	server->dynamic.max_buffer = MAX_CLIENT_BUFSIZ;
+	
+	evhttp_set_gencb(server->http, cps_server_request_handler, server);
+	
+	struct timeval tick = { 0, TIMER_TICK_MS * 1000 };
+	server->poll_timeout = conf->poll_timeout;
+	twheel_init(&server->wheel);
+	twheel_init(&server->idle_wheel);
+	event_set(&server->tick_ev, -1, EV_PERSIST, _cps_server_tick_cb, server);
+	event_base_set(worker->base, &server->tick_ev);
+	event_add(&server->tick_ev, &tick);
+	
+	if (g_nworkers > 1)
+		cps_server_log_info(server, "server listening (worker %d)", worker->id);
+	else
+		cps_server_log_info(server, "server listening");
+	
+	return server;
+}
+
+
+void cps_channel_delete(cps_channel_t *ch) {
+	struct cps_fanout *fanout;
+	cps_sub_t *sub;
+	int i;
+	while ((sub = TAILQ_FIRST(&ch->subs))) {
+		if (sub->ws)
+			cps_ws_close(sub);
+		else
+			cps_sub_close(sub, 1001);
+	}
+	while ((fanout = TAILQ_FIRST(&ch->fanouts))) {
+		TAILQ_REMOVE(&ch->fanouts, fanout, next);
+		cps_fanout_free(ch, fanout);
+	}
+	if (ch->busy)
+		TAILQ_REMOVE(&ch->server->worker->busy, ch, busy_next);
+	event_del(&ch->conflate_ev);
+	cps_channel_latest_clear(ch);
+	twheel_del(&ch->server->idle_wheel, &ch->idle_timer);
+	for (i = 0; i < ch->nlinks; i++)
+		cps_trie_remove(ch->server, &ch->links[i]);
+	free(ch->links);
+	if (ch->own_clients)
+		free(ch->clients);
+	if (ch->own_log) {
+		TAILQ_REMOVE(&ch->server->logged, ch, log_next);
+		msglog_close(ch->log);
+	}
+	cps_history_clear(&ch->history);
+	free(ch->name);
+	free(ch->uri);
+	if (ch->pubkey)
+		free(ch->pubkey);
+}
+
+
+// FNV-1a
+static size_t _cps_channel_hash(const char *name) {
+	size_t hash = 2166136261u;
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+
+// Doubles the hash table once there are more channels than buckets, keeping
+// the chains short.
+static void _cps_channels_grow(cps_server_t *server) {
+	size_t nbuckets = server->nbuckets * 2, i, index;
+	cps_channel_t **buckets, *ch, *next;
+	
+	if (!(buckets = calloc(nbuckets, sizeof(cps_channel_t *))))
+		return;
+	for (i = 0; i < server->nbuckets; i++) {
+		for (ch = server->buckets[i]; ch; ch = next) {
+			next = ch->hnext;
+			index = _cps_channel_hash(ch->name) & (nbuckets - 1);
+			ch->hnext = buckets[index];
+			buckets[index] = ch;
+		}
+	}
+	free(server->buckets);
+	server->buckets = buckets;
+	server->nbuckets = nbuckets;
+}
+
+
+// Unlinks <ch> from its server, closes its subscribers and frees it.
+static void cps_channel_close(cps_channel_t *ch) {
+	cps_server_t *server = ch->server;
+	cps_channel_t **chp = &server->buckets[_cps_channel_hash(ch->name) & (server->nbuckets - 1)];
+	
+	for (; *chp; chp = &(*chp)->hnext) {
+		if (*chp == ch) {
+			*chp = ch->hnext;
+			break;
+		}
+	}
+	TAILQ_REMOVE(&server->channels, ch, next);
+	server->nchannels--;
+	cps_channel_delete(ch);
+	free(ch);
+}
+
+
+void cps_server_delete(cps_server_t *server) {
+	cps_channel_t *ch;
+	while ((ch = TAILQ_FIRST(&server->channels)))
+		cps_channel_close(ch);
+	event_del(&server->tick_ev);
+	free(server->buckets);
+	free(server->name);
+	free(server->channels_uri);
+	free(server->publish_uri);
+	free(server->stats_uri);
+	if (server->pubkey)
+		free(server->pubkey);
+	if (server->dynamic.pubkey)
+		free(server->dynamic.pubkey);
+	evhttp_free(server->http);
+}
+
+
+cps_channel_t *cps_channel_find(cps_server_t *server, const char *name) {
+	cps_channel_t *ch = server->buckets[_cps_channel_hash(name) & (server->nbuckets - 1)];
+	for (; ch; ch = ch->hnext) {
+		if (ch->name[0] == name[0] && strcmp(ch->name, name) == 0)
+			return ch;
+	}
+	return NULL;
+}
+
+
+// Replaces the string at <dst> with a copy of <src>, or NULL if <src> is NULL
+// or empty.
+static void cps_strset(char **dst, const char *src) {
+	free(*dst);
+	*dst = src && *src ? strdup(src) : NULL;
+}
+
+
+// The settings of <server>'s dynamic channels, as a channel configuration
+static void cps_dynamic_conf(cps_server_t *server, struct cps_channel_conf *conf) {
+	memset(conf, 0, sizeof(struct cps_channel_conf));
+	conf->history = server->dynamic.history;
+	conf->pubkey = server->dynamic.pubkey;
+	conf->log_level = server->dynamic.log_level;
+	conf->max_buffer = server->dynamic.max_buffer;
+	conf->overflow = server->dynamic.overflow;
+	conf->conflate = server->dynamic.conflate;
+}
+
+
+static void cps_channel_set_conflate(cps_channel_t *ch, int conflate);
+
+// Opens the message log of <ch> in <conf->persist_dir>, or shares the one a
+// replica on another worker opened. The replica which opened it writes it.
+static void cps_channel_open_log(cps_channel_t *ch, const struct cps_channel_conf *conf) {
+	cps_server_t *server = ch->server;
+	uint64_t last;
+	
+	if (conf->log) {
+		ch->log = conf->log;
+		return;
+	}
+	if (!(ch->log = msglog_open(conf->persist_dir, conf->segment_size))) {
+		cps_channel_log_err(ch, "failed to open message log in %s: %s", conf->persist_dir, strerror(errno));
+		return;
+	}
+	ch->own_log = true;
+	msglog_set_retention(ch->log, conf->persist_max_bytes, conf->persist_max_age);
+	TAILQ_INSERT_TAIL(&server->logged, ch, log_next);
+	// carry on numbering after the messages kept by earlier runs
+	last = msglog_last_seq(ch->log);
+	cps_sequencer_raise(server->sequencer, last);
+	cps_channel_log_info(ch, "message log in %s, last seq %llu", conf->persist_dir, (unsigned long long)last);
+}
+
+
+// Applies <conf> to <ch>, which may have subscribers, queued messages and a
+// conflation window open. Subscribers stay connected.
+static void cps_channel_configure(cps_channel_t *ch, const struct cps_channel_conf *conf) {
+	if (ch->own_log)
+		msglog_set_retention(ch->log, conf->persist_max_bytes, conf->persist_max_age);
+	ch->max_clients = conf->max_clients;
+	ch->log_level = conf->log_level;
+	ch->max_buffer = conf->max_buffer;
+	ch->overflow = conf->overflow;
+	cps_strset(&ch->pubkey, ch->selector ? NULL : conf->pubkey);
+	if (conf->history != ch->history.size && cps_history_resize(&ch->history, conf->history) != 0)
+		cps_channel_log_warn(ch, "failed to allocate history of %d messages", conf->history);
+	// a selector's channels are conflated already, if configured to
+	cps_channel_set_conflate(ch, ch->selector ? 0 : conf->conflate);
+}
+
+
+static cps_channel_t *_cps_channel_open(cps_server_t *server, const char *name,
+	const struct cps_channel_conf *conf, bool dynamic, bool selector)
+{
+	cps_channel_t *channel;
+	size_t index;
+	
+	// the names of selectors were checked one by one when they were normalized
+	if (!selector && !cps_channel_name_valid(name, false)) {
+		cps_server_log_warn(server, "invalid channel name '%s' -- skipping channel", name);
+		return NULL;
+	}
+	if (cps_channel_find(server, name)) {
+		cps_server_log_warn(server, "duplicate channels '%s' -- skipping channel", name);
+		return NULL;
+	}
+	
+	if (!(channel = calloc(1, sizeof(cps_channel_t))))
+		return NULL;
+	
+	channel->name = strdup(name);
+	channel->server = server;
+	channel->dynamic = dynamic;
+	channel->selector = selector;
+	
+	// the replicas of a configured channel share the subscriber count of the
+	// first one opened
+	if (conf->clients) {
+		channel->clients = conf->clients;
+	}
+	else {
+		channel->clients = calloc(1, sizeof(int));
+		channel->own_clients = true;
+	}
+	TAILQ_INIT(&channel->subs);
+	TAILQ_INIT(&channel->fanouts);
+	RB_INIT(&channel->latest);
+	TAILQ_INIT(&channel->latest_order);
+	event_set(&channel->conflate_ev, -1, 0, _cps_channel_conflate_cb, channel);
+	event_base_set(server->worker->base, &channel->conflate_ev);
+	cps_channel_configure(channel, conf);
+	if (conf->persist_dir)
+		cps_channel_open_log(channel, conf);
+	
+	char *uri = calloc(256, 1);
+	snprintf(uri, 255, "%s%s", server->channels_uri, name);
+	channel->uri = uri;
+	
+	if (server->nchannels >= server->nbuckets)
+		_cps_channels_grow(server);
+	index = _cps_channel_hash(name) & (server->nbuckets - 1);
+	channel->hnext = server->buckets[index];
+	server->buckets[index] = channel;
+	server->nchannels++;
+	TAILQ_INSERT_TAIL(&server->channels, channel, next);
+	cps_channel_touch(channel);
+	
+	if (dynamic) {
+		cps_channel_log_debug(channel, "channel created at %s", channel->uri);
+	}
+	else {
+		cps_channel_log_info(channel, "channel opened at %s%s%s", channel->uri,
+			channel->pubkey ? ", publish_key: " : "", channel->pubkey ? channel->pubkey : "");
+	}
+	
+	return channel;
+}
+
+
+// Opens a configured channel. The first replica opened records its subscriber
+// count and message log in <conf> for the others to share.
+cps_channel_t *cps_channel_open(cps_server_t *server, struct cps_channel_conf *conf) {
+	cps_channel_t *ch;
+	if (!(ch = _cps_channel_open(server, conf->name, conf, false, false)))
+		return NULL;
+	if (!conf->clients)
+		conf->clients = ch->clients;
+	if (!conf->log)
+		conf->log = ch->log;
+	return ch;
+}
+
+
+// Returns true if <name> may name a channel, configured or created on demand,
+// or when <pattern> is set, a channel or pattern of a selector. Names end up in
+// callback arguments and event stream fields, so they may not contain quotes,
+// backslashes or control characters, and "*" is only allowed as a whole
+// segment of a pattern.
+static bool cps_channel_name_valid(const char *name, bool pattern) {
+	const char *p;
+	if (!*name || strlen(name) > MAX_CHANNEL_NAME)
+		return false;
+	for (p = name; *p; p++) {
+		if ((unsigned char)*p <= ' ' || *p == '"' || *p == '\\' || *p == ',' || *p == 0x7f)
+			return false;
+		if (*p == '*' && (!pattern || (p > name && p[-1] != '.') || (p[1] && p[1] != '.')))
+			return false;
+	}
+	return true;
+}
+
+
+// Creates channel <name> on first use, with the server's dynamic channel
+// settings.
+static cps_channel_t *cps_channel_open_dynamic(cps_server_t *server, const char *name) {
+	struct cps_channel_conf conf;
+	if (!cps_channel_name_valid(name, false))
+		return NULL;
+	if (server->dynamic.max_channels && server->nchannels >= server->dynamic.max_channels) {
+		cps_server_log_warn(server, "channel limit (%zu) reached -- not creating \"%s\"",
+			server->dynamic.max_channels, name);
+		return NULL;
+	}
+	cps_dynamic_conf(server, &conf);
+	return _cps_channel_open(server, name, &conf, true, false);
+}
+
+
+static int _cps_strcmp(const void *a, const void *b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+
+// Writes the comma-separated channel names and patterns of <list> to <dst>
+// sorted and without duplicates, so that subscribers listening to the same
+// channels share a selector channel. Returns the number of names, or -1 if
+// any of them is invalid or they do not fit.
+static int cps_selector_normalize(char *dst, size_t size, const char *list) {
+	char buf[MAX_SELECTOR], *names[MAX_QUERY_PARAMS * 4], *p, *q;
+	int count = 0, unique = 0, i;
+	size_t length = 0;
+	
+	if (strlen(list) >= sizeof(buf))
+		return -1;
+	strcpy(buf, list);
+	for (p = buf; p; p = q) {
+		if ((q = strchr(p, ',')))
+			*q++ = '\0';
+		if (count == sizeof(names) / sizeof(names[0]) || !cps_channel_name_valid(p, true))
+			return -1;
+		names[count++] = p;
+	}
+	qsort(names, count, sizeof(char *), _cps_strcmp);
+	for (i = 0; i < count; i++) {
+		if (i > 0 && strcmp(names[i], names[i - 1]) == 0)
+			continue;
+		if (length + strlen(names[i]) + 2 > size)
+			return -1;
+		length += sprintf(dst + length, "%s%s", length ? "," : "", names[i]);
+		unique++;
+	}
+	return unique;
+}
+
+
+// Returns true if channel <name> matches <pattern>, the way the trie of
+// selector channels routes it.
+static bool cps_pattern_match(const char *pattern, const char *name) {
+	size_t plen, nlen;
+	for (;;) {
+		plen = strcspn(pattern, ".");
+		nlen = strcspn(name, ".");
+		// a trailing "*" takes the rest, of at least one segment
+		if (plen == 1 && *pattern == '*' && !pattern[1])
+			return true;
+		if ((plen != 1 || *pattern != '*') && (plen != nlen || memcmp(pattern, name, plen) != 0))
+			return false;
+		if (!pattern[plen] || !name[nlen])
+			return !pattern[plen] && !name[nlen];
+		pattern += plen + 1;
+		name += nlen + 1;
+	}
+}
+
+
+// Returns true if every name in <selector> is a configured channel of
+// <server>, and every pattern matches at least one, which is all a server
+// without dynamic channels lets selectors listen to.
+static bool cps_selector_configured(cps_server_t *server, const char *selector) {
+	char buf[MAX_SELECTOR], *p, *q;
+	cps_channel_t *ch;
+	
+	if (strlen(selector) >= sizeof(buf))
+		return false;
+	strcpy(buf, selector);
+	for (p = buf; p; p = q) {
+		if ((q = strchr(p, ',')))
+			*q++ = '\0';
+		if (!strchr(p, '*')) {
+			if (!(ch = cps_channel_find(server, p)) || ch->dynamic)
+				return false;
+			continue;
+		}
+		TAILQ_FOREACH(ch, &server->channels, next) {
+			if (!ch->dynamic && !ch->selector && cps_pattern_match(p, ch->name))
+				break;
+		}
+		if (!ch)
+			return false;
+	}
+	return true;
+}
+
+
+// Creates a selector channel for <selector> -- a normalized list of channel
+// names and patterns -- which gets every message published to a matching
+// channel of its server. Its subscribers see which channel each message came
+// from. Unless the server creates channels on demand, the selector may only
+// list its configured channels.
+static cps_channel_t *cps_channel_open_selector(cps_server_t *server, const char *selector) {
+	struct cps_channel_conf conf;
+	cps_channel_t *ch;
+	const char *p, *q;
+	char name[MAX_CHANNEL_NAME + 1];
+	int i;
+	
+	if (!server->dynamic.enabled && !cps_selector_configured(server, selector)) {
+		cps_server_log_debug(server, "not creating selector \"%s\" of channels which are not configured",
+			selector);
+		return NULL;
+	}
+	if (server->dynamic.max_channels && server->nchannels >= server->dynamic.max_channels) {
+		cps_server_log_warn(server, "channel limit (%zu) reached -- not creating \"%s\"",
+			server->dynamic.max_channels, selector);
+		return NULL;
+	}
+	cps_dynamic_conf(server, &conf);
+	if (!(ch = _cps_channel_open(server, selector, &conf, true, true)))
+		return NULL;
+	for (ch->nlinks = 1, p = selector; (p = strchr(p, ',')); p++)
+		ch->nlinks++;
+	if (!(ch->links = calloc(ch->nlinks, sizeof(struct cps_chlink)))) {
+		cps_channel_close(ch);
+		return NULL;
+	}
+	for (i = 0, p = selector; i < ch->nlinks; i++, p = q + 1) {
+		if (!(q = strchr(p, ',')))
+			q = p + strlen(p);
+		memcpy(name, p, q - p);
+		name[q - p] = '\0';
+		ch->links[i].channel = ch;
+		if (cps_trie_add(server, &ch->links[i], name) != 0) {
+			ch->nlinks = i;
+			cps_channel_close(ch);
+			return NULL;
+		}
+	}
+	return ch;
+}
+
+
+// ------------------------------------------------------------------------------------------
+// workers
+
+// Pushes the envelopes <first> to <last>, linked newest first, onto the inbox
+// of <worker> at once. Safe to call from any thread. Returns true if the inbox
+// was empty, in which case the worker needs to be woken by cps_worker_notify.
+static bool cps_worker_push_chain(cps_worker_t *worker, cps_envelope_t *first, cps_envelope_t *last) {
+	cps_envelope_t *head = __atomic_load_n(&worker->inbox, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&worker->inbox, &head, first, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return head == NULL;
+}
+
+
+static void cps_worker_notify(cps_worker_t *worker) {
+	if (write(worker->notify_fds[1], "", 1) == -1)
+		cps_warn("failed to notify worker %d", worker->id);
+}
+
+
+// Pushes <env> onto the inbox of <worker>. Safe to call from any thread.
+static void cps_worker_push(cps_worker_t *worker, cps_envelope_t *env) {
+	// only the push which made the inbox non-empty needs to wake the worker
+	if (cps_worker_push_chain(worker, env, env))
+		cps_worker_notify(worker);
+}
+
+
+// Has <worker> call <call> with <arg> on its own thread, in turn with the
+// messages in its inbox. The envelope's release and acquire make whatever
+// the caller wrote to <arg> visible to the worker.
+static void cps_worker_call(cps_worker_t *worker, void (*call)(cps_worker_t *, void *), void *arg) {
+	cps_envelope_t *env;
+	if (!(env = malloc(sizeof(cps_envelope_t)))) {
+		cps_warn("failed to allocate envelope for worker %d", worker->id);
+		return;
+	}
+	env->msg = NULL;
+	env->call = call;
+	env->arg = arg;
+	env->keep = false;
+	cps_worker_push(worker, env);
+}
+
+
+// The number <sequencer> gave out last, or the last one taken before it
+// started. Safe to call from any thread.
+static uint64_t cps_sequencer_last(struct cps_sequencer *sequencer) {
+	uint64_t last = __atomic_load_n(&sequencer->last, __ATOMIC_RELAXED);
+	uint64_t floor = __atomic_load_n(&sequencer->floor, __ATOMIC_RELAXED);
+	return last > floor ? last : floor;
+}
+
+
+// Whether <sequencer> has given out every number left to it while an upgraded
+// process starts. Safe to call from any thread.
+static bool cps_sequencer_full(struct cps_sequencer *sequencer) {
+	uint64_t limit = __atomic_load_n(&sequencer->limit, __ATOMIC_RELAXED);
+	return limit && cps_sequencer_last(sequencer) + 1 >= limit;
+}
+
+
+// Has <sequencer> number messages after <seq>, unless it is past it already.
+// Safe to call from any thread.
+static void cps_sequencer_raise(struct cps_sequencer *sequencer, uint64_t seq) {
+	uint64_t floor = __atomic_load_n(&sequencer->floor, __ATOMIC_RELAXED);
+	while (floor < seq && !__atomic_compare_exchange_n(&sequencer->floor, &floor, seq, true,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+// Takes the messages published to a server since it was last drained,
+// numbers them and hands them to every worker in publish order, one chain of
+// envelopes per worker. Runs on the first worker only.
+static void _cps_sequencer_drain_cb(cps_worker_t *worker, void *_sequencer) {
+	struct cps_sequencer *sequencer = (struct cps_sequencer *)_sequencer;
+	cps_envelope_t *first[MAX_WORKERS], *last[MAX_WORKERS], *env;
+	cps_msg_t *msg, *next, *msgs = NULL;
+	uint64_t seq = cps_sequencer_last(sequencer);
+	uint64_t limit = __atomic_load_n(&sequencer->limit, __ATOMIC_RELAXED);
+	int i;
+	
+	// take the whole ingress and reverse it into publish order
+	msg = __atomic_exchange_n(&sequencer->ingress, NULL, __ATOMIC_ACQUIRE);
+	for (; msg; msg = next) {
+		next = msg->next;
+		msg->next = msgs;
+		msgs = msg;
+	}
+	
+	// one chain per worker, newest first like the inbox
+	for (i = 0; i < g_nworkers; i++)
+		first[i] = last[i] = NULL;
+	for (msg = msgs; msg; msg = next) {
+		next = msg->next;
+		// published before the limit was set, and past it by now
+		if (limit && seq + 1 >= limit) {
+			cps_warn("upgrade: dropped a message to %s past the numbers left to this process", msg->channel);
+			cps_msg_release(msg);
+			continue;
+		}
+		msg->seq = ++seq;
+		for (i = 0; i < g_nworkers; i++) {
+			if (!(env = malloc(sizeof(cps_envelope_t)))) {
+				cps_warn("failed to allocate envelope for worker %d", i);
+				continue;
+			}
+			cps_msg_retain(msg);
+			env->msg = msg;
+			env->next = first[i];
+			first[i] = env;
+			if (!last[i])
+				last[i] = env;
+		}
+		cps_msg_release(msg);
+	}
+	__atomic_store_n(&sequencer->last, seq, __ATOMIC_RELAXED);
+	for (i = 0; i < g_nworkers; i++) {
+		if (first[i] && cps_worker_push_chain(&g_workers[i], first[i], last[i]))
+			cps_worker_notify(&g_workers[i]);
+	}
+}
+
+
+static struct cps_sequencer *cps_sequencer_new(void) {
+	struct cps_sequencer *sequencer;
+	if (!(sequencer = calloc(1, sizeof(struct cps_sequencer))))
+		return NULL;
+	sequencer->drain.call = _cps_sequencer_drain_cb;
+	sequencer->drain.arg = sequencer;
+	sequencer->drain.keep = true;
+	return sequencer;
+}
+
+
+// Queues <msg>, taking over the caller's reference, to be handed to every
+// worker by <sequencer>. Safe to call from any thread.
+static void cps_sequencer_push(struct cps_sequencer *sequencer, cps_msg_t *msg) {
+	cps_msg_t *head = __atomic_load_n(&sequencer->ingress, __ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&sequencer->ingress, &head, msg, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	// only the push which made the ingress non-empty has it drained; until
+	// the first worker takes everything off it, <drain> is not pushed again
+	if (head == NULL)
+		cps_worker_push(&g_workers[0], &sequencer->drain);
+}
+
+
+static void _cps_worker_notify_cb(int fd, short what, void *_worker) {
+	cps_worker_t *worker = (cps_worker_t *)_worker;
+	cps_envelope_t *env, *next, *envs = NULL;
+	cps_server_t *server;
+	cps_channel_t *ch;
+	char buf[256];
+	
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	
+	// take the whole inbox and reverse it into publish order
+	env = __atomic_exchange_n(&worker->inbox, NULL, __ATOMIC_ACQUIRE);
+	for (; env; env = next) {
+		next = env->next;
+		env->next = envs;
+		envs = env;
+	}
+	
+	for (env = envs; env; env = next) {
+		next = env->next;
+		if (!env->msg) {
+			env->call(worker, env->arg);
+			if (!env->keep)
+				free(env);
+			continue;
+		}
+		// dynamic channels are created here too, so that every worker keeps
+		// the same history
+		if ((server = cps_worker_server(worker, env->msg->server_id))
+			&& ((ch = cps_channel_find(server, env->msg->channel))
+				|| (server->dynamic.enabled && (ch = cps_channel_open_dynamic(server, env->msg->channel)))))
+		{
+			cps_channel_pub(ch, env->msg);
+		}
+		cps_msg_release(env->msg);
+		free(env);
+	}
+}
+
+
+static void _cps_worker_stop_cb(cps_worker_t *worker, void *arg) {
+	event_base_loopbreak(worker->base);
+}
+
+
+static void *_cps_worker_main(void *_worker) {
+	cps_worker_t *worker = (cps_worker_t *)_worker;
+	event_base_dispatch(worker->base);
+	return NULL;
+}
+
+
+// Sets up <count> workers. Worker 0 uses <base> and runs on the main thread;
+// the others get their own event bases and are started by cps_workers_run.
+static int cps_workers_init(struct event_base *base, int count) {
+	cps_worker_t *worker;
+	int i;
+	
+	if (!(g_workers = calloc(count, sizeof(cps_worker_t))))
+		return -1;
+	g_nworkers = count;
+	
+	for (i = 0; i < count; i++) {
+		worker = &g_workers[i];
+		worker->id = i;
+		worker->base = i == 0 ? base : event_base_new();
+		worker->scratch = evbuffer_new();
+		slab_init(&worker->subs, "subs", sizeof(cps_sub_t), SLAB_CHUNK_OBJECTS);
+		slab_init(&worker->bodies, "bodies", BODY_SLAB_SIZE, SLAB_CHUNK_OBJECTS);
+		slab_init(&worker->queries, "queries", sizeof(cps_query_t), 4);
+		slab_init(&worker->qents, "queued", sizeof(struct cps_qent), SLAB_CHUNK_OBJECTS);
+		slab_init(&worker->fanouts, "fanouts", sizeof(struct cps_fanout), SLAB_CHUNK_OBJECTS);
+		TAILQ_INIT(&worker->busy);
+		event_set(&worker->fanout_ev, -1, 0, _cps_worker_fanout_cb, worker);
+		event_base_set(worker->base, &worker->fanout_ev);
+		TAILQ_INIT(&worker->servers);
+		if (!worker->base || !worker->scratch || pipe(worker->notify_fds) == -1) {
+			cps_warn("failed to set up worker %d", i);
+			return -1;
+		}
+		// not left open in a process started by an upgrade
+		fcntl(worker->notify_fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(worker->notify_fds[1], F_SETFD, FD_CLOEXEC);
+		fcntl(worker->notify_fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(worker->notify_fds[1], F_SETFL, O_NONBLOCK);
+		worker->stop.call = _cps_worker_stop_cb;
+		worker->stop.keep = true;
+		event_set(&worker->notify_ev, worker->notify_fds[0], EV_READ|EV_PERSIST,
+			_cps_worker_notify_cb, worker);
+		event_base_set(worker->base, &worker->notify_ev);
+		event_add(&worker->notify_ev, NULL);
+	}
+	return 0;
+}
+
+
+static void cps_workers_run(void) {
+	int i;
+	for (i = 1; i < g_nworkers; i++) {
+		if (pthread_create(&g_workers[i].thread, NULL, _cps_worker_main, &g_workers[i]) != 0)
+			err(1, "failed to start worker %d", i);
+	}
+}
+
+
+// Has every worker leave its event loop once it is done with what it is
+// doing, the first one included, so that main can join the others before
+// it writes out the logs and exits. Runs on the first worker.
+static void cps_workers_stop(void) {
+	static bool stopping = false;
+	int i;
+	if (stopping)
+		return;
+	stopping = true;
+	for (i = 1; i < g_nworkers; i++)
+		cps_worker_push(&g_workers[i], &g_workers[i].stop);
+	event_base_loopbreak(g_workers[0].base);
+}
+
+
+static void cps_workers_join(void) {
+	int i;
+	for (i = 1; i < g_nworkers; i++)
+		pthread_join(g_workers[i].thread, NULL);
+}
+
+// ------------------------------------------------------------------------------------------
+// configuration
+
+static void cps_config_free(struct cps_config *config) {
+	struct cps_server_conf *sconf;
+	int i, j;
+	for (i = 0; i < config->nservers; i++) {
+		sconf = &config->servers[i];
+		free(sconf->name);
+		free(sconf->address);
+		free(sconf->channels_uri);
+		free(sconf->publish_uri);
+		free(sconf->stats_uri);
+		free(sconf->pubkey);
+		free(sconf->dynamic.pubkey);
+		for (j = 0; j < sconf->nchannels; j++) {
+			free(sconf->channels[j].name);
+			free(sconf->channels[j].pubkey);
+			free(sconf->channels[j].persist_dir);
+		}
+		free(sconf->channels);
+	}
+	free(config->servers);
+	for (i = 0; i < config->ngarbage; i++)
+		config->garbage[i].release(config->garbage[i].p);
+	free(config->garbage);
+	free(config);
+}
+
 
-typedef struct cps_channel cps_channel_t;
-typedef struct cps_server cps_server_t;
-typedef struct cps_sub cps_sub_t;
+static char *cps_config_strdup(const char *s) {
+	return s && *s ? strdup(s) : NULL;
+}
 
-struct cps_servers g_servers;
-int g_verbosity = 1;
 
-static const char *_evhttp_peername(struct evhttp_connection *evcon) {
-	static char buf[128];
-	char *address;
-	u_short port;
-	evhttp_connection_get_peer(evcon, &address, &port);
-	snprintf(buf, sizeof(buf), "%s:%d", address, port);
-	return (buf);
+// A server conf with the settings given on the command line. Servers from the
+// configuration file start out like this too.
+static struct cps_server_conf *cps_config_add_server(struct cps_config *config, const struct cps_defaults *defaults,
+	const char *address, int port)
+{
+	struct cps_server_conf *sconf, *servers;
+	char name[256];
+	int i;
+	
+	snprintf(name, sizeof(name), "%s:%d", address, port);
+	for (i = 0; i < config->nservers; i++) {
+		if (strcmp(config->servers[i].name, name) == 0) {
+			cps_log(config->log_level, CPS_LOG_WARN, "duplicate server %s -- skipping server", name);
+			return NULL;
+		}
+	}
+	if (!(servers = realloc(config->servers, (config->nservers + 1) * sizeof(struct cps_server_conf))))
+		return NULL;
+	config->servers = servers;
+	sconf = &config->servers[config->nservers++];
+	memset(sconf, 0, sizeof(struct cps_server_conf));
+	sconf->id = -1;
+	sconf->name = strdup(name);
+	sconf->address = strdup(address);
+	sconf->port = port;
+	sconf->log_level = config->log_level;
+	sconf->poll_timeout = defaults->poll_timeout;
+	sconf->max_connections = defaults->max_connections;
+	sconf->retry_after = DEFAULT_RETRY_AFTER;
+	sconf->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+	sconf->compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+	sconf->channels_uri = strdup(DEFAULT_CHANNELS_URI);
+	sconf->publish_uri = strdup(DEFAULT_PUBLISH_URI);
+	sconf->stats_uri = strdup(DEFAULT_STATS_URI);
+	sconf->pubkey = cps_config_strdup(defaults->pubkey);
+	sconf->dynamic.history = DEFAULT_HISTORY;
+	sconf->dynamic.log_level = config->log_level;
+	sconf->dynamic.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	sconf->dynamic.max_buffer = MAX_CLIENT_BUFSIZ;
+	return sconf;
 }
 
 
-static cps_sub_t *cps_sub_open(cps_channel_t *ch, struct evhttp_request *req) {
-	cps_sub_t *sub;
-	if (!(sub = calloc(1, sizeof(cps_sub_t))))
+static struct cps_channel_conf *cps_config_add_channel(struct cps_server_conf *sconf, const char *name) {
+	struct cps_channel_conf *cconf, *channels;
+	if (!(channels = realloc(sconf->channels, (sconf->nchannels + 1) * sizeof(struct cps_channel_conf))))
 		return NULL;
-	sub->req = req;
-	sub->channel = ch;
-	TAILQ_INSERT_TAIL(&ch->subs, sub, next);
-	cps_sub_log_info(sub, "listening");
-	return sub;
+	sconf->channels = channels;
+	cconf = &sconf->channels[sconf->nchannels++];
+	memset(cconf, 0, sizeof(struct cps_channel_conf));
+	cconf->name = strdup(name);
+	cconf->history = DEFAULT_HISTORY;
+	cconf->log_level = sconf->log_level;
+	cconf->max_buffer = MAX_CLIENT_BUFSIZ;
+	return cconf;
 }
 
 
-// JSONP responder
-static void cps_sub_pub(struct cps_sub *sub, const char *sender, struct evbuffer *msgbuf) {
-	struct evbuffer *bodybuf;
-	const char *jsonp_callback = NULL;
-	struct evkeyvalq *query = NULL;
-	
-	if (strstr(sub->req->uri, "jsonp=")) {
-		query = calloc(1, sizeof(struct evkeyvalq));
-		evhttp_parse_query(sub->req->uri, query);
-		jsonp_callback = evhttp_find_header(query, "jsonp");
+// Replaces *<dst> with a copy of the string at <path> under <node>, if there
+// is one and it is not empty.
+static void cps_config_get_str(yconf_t *config, yaml_node_t *node, const char *path, char **dst) {
+	const char *value = yconf_get_str2(config, node, path, NULL);
+	if (value && *value) {
+		free(*dst);
+		*dst = strdup(value);
 	}
-	
-	if (!jsonp_callback)
-		jsonp_callback = "jsonpcallback";
-	
-	bodybuf = evbuffer_new();
-	evbuffer_add_printf(bodybuf, "%s(", jsonp_callback);
-	evbuffer_add(bodybuf, EVBUFFER_DATA(msgbuf), EVBUFFER_LENGTH(msgbuf));
-	evbuffer_add(bodybuf, (const void *)");", 2);
-	
-	cps_sub_log_debug(sub, "sending message(%llu)", (unsigned long long)EVBUFFER_LENGTH(bodybuf));
-	evhttp_add_header(sub->req->output_headers, "Content-Type", "text/javascript; charset=utf-8");
-	evhttp_send_reply(sub->req, 200, "OK", bodybuf);
-	
-	evbuffer_free(bodybuf);
-	if (query)
-		free(query);
-	
-	TAILQ_REMOVE(&sub->channel->subs, sub, next);
-	free(sub);
 }
 
 
-static void cps_channel_pub(cps_channel_t *ch, const char *sender, struct evbuffer *buf) {
-	struct cps_sub *sub;
-	int subcount = 0;
-	cps_channel_log_info(ch, "publishing %llu bytes", (unsigned long long)EVBUFFER_LENGTH(buf));
-	TAILQ_FOREACH(sub, &ch->subs, next) {
-		subcount++;
-		cps_sub_pub(sub, sender, buf);
+static void cps_config_get_overflow(yconf_t *config, yaml_node_t *node, int log_level, enum cps_overflow *overflow) {
+	const char *value = yconf_get_str2(config, node, "overflow", NULL);
+	if (value && cps_overflow_parse(value, overflow) != 0) {
+		cps_log(log_level, CPS_LOG_WARN, "unknown overflow policy '%s' -- using %s", value,
+			cps_overflow_names[*overflow]);
 	}
-	cps_channel_log_debug(ch, "published %llu bytes to %d subscribers",
-		(unsigned long long)EVBUFFER_LENGTH(buf), subcount);
 }
 
 
-void cps_channel_request_handler(struct evhttp_request *req, void *_channel) {
-	cps_channel_t *ch = (cps_channel_t *)_channel;
-	//cps_server_t *server = (cps_server_t *)_server;
-	switch (req->type) {
-	case EVHTTP_REQ_GET: {
-		cps_channel_log_debug(ch, "GET %s from %s:%d", req->uri, req->remote_host, req->remote_port);
-		cps_sub_open(ch, req);
-		break;
+// Reads the "persist" section of a channel, which has its messages kept on
+// disk in a directory of <data_dir> named after the server and channel.
+static void cps_config_get_persist(yconf_t *config, yaml_node_t *node, const char *data_dir,
+	struct cps_server_conf *sconf, struct cps_channel_conf *cconf)
+{
+	yaml_node_t *persist = yconf_find_node2(config, node, "persist", true);
+	char path[4096];
+	size_t length;
+	const char *p;
+	
+	if (!persist || (persist->type != YAML_MAPPING_NODE && !yconf_get_bool2(config, node, "persist", false)))
+		return;
+	// anything but letters, digits, "-" and "_" is %-escaped, so names can not
+	// reach outside the directory
+	length = (size_t)snprintf(path, sizeof(path), "%s/%s_%d/", data_dir, sconf->address, sconf->port);
+	for (p = cconf->name; *p && length + 4 < sizeof(path); p++) {
+		if (isalnum((unsigned char)*p) || *p == '-' || *p == '_')
+			path[length++] = *p;
+		else
+			length += (size_t)snprintf(path + length, 4, "%%%02X", (unsigned char)*p);
 	}
-	case EVHTTP_REQ_POST: {
-		cps_channel_log_debug(ch, "POST %s from %s:%d", req->uri, req->remote_host, req->remote_port);
-		// publish-key
-		if (ch->pubkey && strlen(ch->pubkey)) {
-			const char *key = evhttp_find_header(req->input_headers, "X-CPS-Publish-Key");
-			if (key == NULL) {
-				cps_channel_log_warn(ch, "bad pubkey (missing) from %s:%d", req->remote_host, req->remote_port);
-				evhttp_send_reply(req, 400, "Bad Request", NULL);
-				return;
-			}
-			else if (strcmp(key, ch->pubkey) != 0) {
-				cps_channel_log_warn(ch, "bad pubkey (mismatch) from %s:%d", req->remote_host, req->remote_port);
-				evhttp_send_reply(req, 401, "Unauthorized", NULL);
-				return;
-			}
-		}
-		// publish
-		cps_channel_pub(ch, _evhttp_peername(req->evcon), req->input_buffer);
-		// empty OK reply
-		evhttp_send_reply(req, HTTP_NOCONTENT, "OK", NULL);
-		break;
+	path[length] = '\0';
+	cconf->persist_dir = strdup(path);
+	if (persist->type == YAML_MAPPING_NODE) {
+		cconf->segment_size = (size_t)yconf_get_int2(config, persist, "segment_size", DEFAULT_SEGMENT_SIZE);
+		cconf->persist_max_bytes = (size_t)yconf_get_int2(config, persist, "max_bytes", 0);
+		cconf->persist_max_age = (int)yconf_get_int2(config, persist, "max_age", 0);
 	}
-	default:
-		cps_channel_log_warn(ch, "bad request method from %s:%d", req->remote_host, req->remote_port);
-		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
-		break;
+	else {
+		cconf->segment_size = DEFAULT_SEGMENT_SIZE;
 	}
 }
 
-void cps_server_request_handler(struct evhttp_request *req, void *_server) {
-	cps_server_t *server = (cps_server_t *)_server;
-	cps_server_log_debug(server, "unhandled request (404) for \"%s\" from %s:%d",
-		req->uri, req->remote_host, req->remote_port);
-	evhttp_send_reply(req, 404, "Not Found", NULL);
+
+// Returns the id of the running server called <name>, or a new one.
+static int cps_config_server_id(const char *name) {
+	static int next_id = 0;
+	cps_server_t *server;
+	TAILQ_FOREACH(server, &g_workers[0].servers, next) {
+		if (strcmp(server->name, name) == 0)
+			return server->id;
+	}
+	return next_id++;
 }
 
 
-cps_server_t *cps_server_start(const char *address, int port, int log_level) {
-	cps_server_t *server = calloc(1, sizeof(cps_server_t));
+// Reads the servers and channels of a configuration file. Settings a server
+// does not have fall back on the top level of the file, and then on the
+// command line; channels fall back on their server.
+static struct cps_config *cps_config_read(yconf_t *config, const struct cps_defaults *defaults) {
+	struct cps_config *conf;
+	struct cps_server_conf *sconf;
+	struct cps_channel_conf *cconf;
+	yaml_node_t *srvs, *srv, *dyn, *chnls, *chname, *chnl;
 	
-	server->log_level = log_level;
-	server->http = evhttp_new(NULL);
-	
-	if (server->http == NULL) {
-		cps_warn("failed to allocate http server");
-		free(server);
+	if (!(conf = calloc(1, sizeof(struct cps_config))))
 		return NULL;
+	// -v and -s make the configured level more or less verbose
+	conf->log_level = (int)yconf_get_int(config, "log_level", CPS_LOG_INFO) + defaults->log_level - CPS_LOG_INFO;
+	if (!(srvs = yconf_find_node(config, "servers", true)) || srvs->type != YAML_SEQUENCE_NODE)
+		return conf;
+	
+	yconf_list_foreach(config, srvs, srv) {
+		if (!(sconf = cps_config_add_server(conf, defaults, yconf_get_str2(config, srv, "address", defaults->address),
+			(int)yconf_get_int2(config, srv, "port", defaults->port))))
+		{
+			continue;
+		}
+		free(sconf->pubkey);
+		sconf->pubkey = NULL;
+		sconf->id = cps_config_server_id(sconf->name);
+		sconf->log_level = (int)yconf_get_int2(config, srv, "log_level", conf->log_level);
+		sconf->poll_timeout = (int)yconf_get_int2(config, srv, "poll_timeout",
+			yconf_get_int(config, "poll_timeout", defaults->poll_timeout));
+		sconf->max_connections = (int)yconf_get_int2(config, srv, "max_connections",
+			yconf_get_int(config, "max_connections", defaults->max_connections));
+		sconf->retry_after = (int)yconf_get_int2(config, srv, "retry_after",
+			yconf_get_int(config, "retry_after", DEFAULT_RETRY_AFTER));
+		sconf->drain_timeout = (int)yconf_get_int2(config, srv, "drain_timeout",
+			yconf_get_int(config, "drain_timeout", DEFAULT_DRAIN_TIMEOUT));
+		sconf->compress_min_size = (size_t)yconf_get_int2(config, srv, "compress_min_size",
+			yconf_get_int(config, "compress_min_size", DEFAULT_COMPRESS_MIN_SIZE));
+		if (!yconf_get_bool2(config, srv, "compress", yconf_get_bool(config, "compress", true)))
+			sconf->compress_min_size = 0;
+		cps_config_get_str(config, srv, "channels_uri", &sconf->channels_uri);
+		cps_config_get_str(config, srv, "publish_uri", &sconf->publish_uri);
+		cps_config_get_str(config, srv, "stats_uri", &sconf->stats_uri);
+		cps_config_get_str(config, srv, "publish_key", &sconf->pubkey);
+		
+		// channels created on first use
+		sconf->dynamic.log_level = sconf->log_level;
+		if ((dyn = yconf_find_node2(config, srv, "dynamic_channels", true)) && dyn->type == YAML_MAPPING_NODE) {
+			sconf->dynamic.enabled = true;
+			sconf->dynamic.history = (int)yconf_get_int2(config, dyn, "history", DEFAULT_HISTORY);
+			cps_config_get_str(config, dyn, "publish_key", &sconf->dynamic.pubkey);
+			sconf->dynamic.log_level = (int)yconf_get_int2(config, dyn, "log_level", sconf->log_level);
+			sconf->dynamic.idle_timeout = (int)yconf_get_int2(config, dyn, "idle_timeout", DEFAULT_IDLE_TIMEOUT);
+			sconf->dynamic.max_channels = (size_t)yconf_get_int2(config, dyn, "max_channels", 0);
+			sconf->dynamic.max_buffer = (size_t)yconf_get_int2(config, dyn, "max_buffer", MAX_CLIENT_BUFSIZ);
+			sconf->dynamic.conflate = (int)yconf_get_int2(config, dyn, "conflate", 0);
+			cps_config_get_overflow(config, dyn, sconf->log_level, &sconf->dynamic.overflow);
+		}
+		
+		// channels
+		if ((chnls = yconf_find_node2(config, srv, "channels", true)) && chnls->type == YAML_MAPPING_NODE) {
+			yconf_map_foreach(config, chnls, chname, chnl) {
+				if (chname->type != YAML_SCALAR_NODE)
+					continue;
+				if (!cps_channel_name_valid((const char *)chname->data.scalar.value, false)) {
+					cps_log(sconf->log_level, CPS_LOG_WARN, "invalid channel name '%s' on %s -- skipping",
+						(const char *)chname->data.scalar.value, sconf->name);
+					continue;
+				}
+				if (!(cconf = cps_config_add_channel(sconf, (const char *)chname->data.scalar.value)))
+					continue;
+				cconf->max_clients = (int)yconf_get_int2(config, chnl, "max_clients", 0);
+				cconf->history = (int)yconf_get_int2(config, chnl, "history", DEFAULT_HISTORY);
+				cps_config_get_str(config, chnl, "publish_key", &cconf->pubkey);
+				cconf->log_level = (int)yconf_get_int2(config, chnl, "log_level", sconf->log_level);
+				cconf->max_buffer = (size_t)yconf_get_int2(config, chnl, "max_buffer", MAX_CLIENT_BUFSIZ);
+				cconf->conflate = (int)yconf_get_int2(config, chnl, "conflate", 0);
+				cps_config_get_overflow(config, chnl, cconf->log_level, &cconf->overflow);
+				cps_config_get_persist(config, chnl, yconf_get_str2(config, srv, "data_dir",
+					yconf_get_str(config, "data_dir", DEFAULT_DATA_DIR)), sconf, cconf);
+			}
+		}
 	}
+	return conf;
+}
+
+
+// The server given on the command line, with its one channel
+static struct cps_config *cps_config_from_args(const struct cps_defaults *defaults) {
+	struct cps_config *conf;
+	struct cps_server_conf *sconf;
+	struct cps_channel_conf *cconf;
 	
-	if (evhttp_bind_socket(server->http, address, port) == -1) {
-		cps_warn("failed to bind http server to %s:%d", address, port);
-		free(server->http);
-		free(server);
+	if (!(conf = calloc(1, sizeof(struct cps_config))))
 		return NULL;
+	conf->log_level = defaults->log_level;
+	if (!(sconf = cps_config_add_server(conf, defaults, defaults->address, defaults->port)))
+		return conf;
+	sconf->id = cps_config_server_id(sconf->name);
+	if (defaults->dynamic) {
+		sconf->dynamic.enabled = true;
+		sconf->dynamic.pubkey = cps_config_strdup(defaults->pubkey);
 	}
+	if ((cconf = cps_config_add_channel(sconf, defaults->channel)))
+		cconf->pubkey = cps_config_strdup(defaults->pubkey);
+	return conf;
+}
+
+
+// Keeps <p> until every worker has applied <config>, for the replicas on
+// workers yet to apply it may still be using it, and then has <release> free
+// it.
+static void cps_config_discard(struct cps_config *config, void *p, void (*release)(void *)) {
+	struct cps_garbage *garbage;
+	int i;
+	for (i = 0; i < config->ngarbage; i++) {
+		if (config->garbage[i].p == p)
+			return;
+	}
+	if (!(garbage = realloc(config->garbage, (config->ngarbage + 1) * sizeof(struct cps_garbage))))
+		return; // leaked rather than freed too early
+	config->garbage = garbage;
+	config->garbage[config->ngarbage].p = p;
+	config->garbage[config->ngarbage++].release = release;
+}
+
+
+static void _cps_config_close_log(void *log) {
+	msglog_close((msglog_t *)log);
+}
+
+
+// Stops keeping a log of <ch>'s messages. The replica which writes it leaves
+// it to <config> to close.
+static void cps_config_release_log(struct cps_config *config, cps_channel_t *ch) {
+	if (ch->own_log) {
+		TAILQ_REMOVE(&ch->server->logged, ch, log_next);
+		ch->own_log = false;
+		cps_config_discard(config, ch->log, _cps_config_close_log);
+	}
+	ch->log = NULL;
+}
+
+
+// Closes a configured channel which is no longer in the configuration.
+static void cps_config_close_channel(struct cps_config *config, cps_channel_t *ch) {
+	if (!ch->dynamic) {
+		ch->own_clients = false;
+		cps_config_discard(config, ch->clients, free);
+		cps_config_release_log(config, ch);
+	}
+	cps_channel_close(ch);
+}
+
+
+// Brings <server> (new or running) in line with <sconf>: updates its settings
+// and those of its channels in place, opens the channels which were added and
+// closes those which were removed. Subscribers of the channels which stay
+// keep their connections.
+static void cps_server_configure(cps_server_t *server, struct cps_server_conf *sconf, struct cps_config *config) {
+	struct cps_channel_conf dynconf;
+	cps_channel_t *ch, *next;
+	int i;
 	
-	char *name = calloc(256, 1);
-	snprintf(name, 255, "%s:%d", address, port);
-	server->name = name;
-	
-	TAILQ_INIT(&server->channels);
+	server->log_level = sconf->log_level;
+	server->poll_timeout = sconf->poll_timeout;
+	server->max_connections = sconf->max_connections;
+	server->retry_after = sconf->retry_after;
+	server->drain_timeout = sconf->drain_timeout;
+	server->compress_min_size = sconf->compress_min_size;
+	cps_strset(&server->channels_uri, sconf->channels_uri);
+	cps_strset(&server->publish_uri, sconf->publish_uri);
+	cps_strset(&server->stats_uri, sconf->stats_uri);
+	cps_strset(&server->pubkey, sconf->pubkey);
+	free(server->dynamic.pubkey);
+	server->dynamic = sconf->dynamic;
+	server->dynamic.pubkey = cps_config_strdup(sconf->dynamic.pubkey);
+	cps_dynamic_conf(server, &dynconf);
 	
-	evhttp_set_gencb(server->http, cps_server_request_handler, server);
+	for (ch = TAILQ_FIRST(&server->channels); ch; ch = next) {
+		next = TAILQ_NEXT(ch, next);
+		if (ch->dynamic) {
+			cps_channel_configure(ch, &dynconf);
+			continue;
+		}
+		for (i = 0; i < sconf->nchannels && strcmp(sconf->channels[i].name, ch->name) != 0; i++)
+			;
+		if (i == sconf->nchannels) {
+			cps_channel_log_info(ch, "no longer configured -- closing channel");
+			cps_config_close_channel(config, ch);
+		}
+	}
+	for (i = 0; i < sconf->nchannels; i++) {
+		if (!(ch = cps_channel_find(server, sconf->channels[i].name))) {
+			cps_channel_open(server, &sconf->channels[i]);
+		}
+		else if (!ch->selector) {
+			// a dynamic channel by that name is kept, and kept open
+			if (ch->dynamic) {
+				ch->dynamic = false;
+				twheel_del(&server->idle_wheel, &ch->idle_timer);
+			}
+			if (ch->log && !sconf->channels[i].persist_dir)
+				cps_config_release_log(config, ch);
+			else if (!ch->log && sconf->channels[i].persist_dir)
+				cps_channel_open_log(ch, &sconf->channels[i]);
+			if (!sconf->channels[i].log)
+				sconf->channels[i].log = ch->log;
+			// like the log, the first replica's subscriber count is shared; a
+			// replica which was dynamic on another worker adds its own to it
+			if (!sconf->channels[i].clients) {
+				sconf->channels[i].clients = ch->clients;
+			}
+			else if (ch->clients != sconf->channels[i].clients) {
+				__atomic_add_fetch(sconf->channels[i].clients, __atomic_load_n(ch->clients, __ATOMIC_RELAXED),
+					__ATOMIC_RELAXED);
+				if (ch->own_clients)
+					free(ch->clients);
+				ch->clients = sconf->channels[i].clients;
+				ch->own_clients = false;
+			}
+			cps_channel_configure(ch, &sconf->channels[i]);
+		}
+	}
+}
+
+
+// Stops a server which is no longer in the configuration, closing its
+// channels and connections.
+static void cps_config_stop_server(struct cps_config *config, cps_server_t *server) {
+	cps_channel_t *ch;
+	cps_server_log_info(server, "no longer configured -- stopping server");
+	TAILQ_FOREACH(ch, &server->channels, next) {
+		if (!ch->dynamic) {
+			ch->own_clients = false;
+			cps_config_discard(config, ch->clients, free);
+			cps_config_release_log(config, ch);
+		}
+	}
+	cps_config_discard(config, server->sequencer, free);
+	cps_config_discard(config, server->connections, free);
+	TAILQ_REMOVE(&server->worker->servers, server, next);
+	cps_server_delete(server);
+	free(server);
+}
+
+
+// Brings the replicas run by <worker> in line with <config>.
+static void cps_config_apply(cps_worker_t *worker, struct cps_config *config) {
+	struct cps_server_conf *sconf;
+	cps_server_t *server, *next;
+	int i;
 	
-	cps_server_log_info(server, "server listening");
+	for (server = TAILQ_FIRST(&worker->servers); server; server = next) {
+		next = TAILQ_NEXT(server, next);
+		for (i = 0; i < config->nservers && strcmp(config->servers[i].name, server->name) != 0; i++)
+			;
+		if (i == config->nservers)
+			cps_config_stop_server(config, server);
+	}
+	for (i = 0; i < config->nservers; i++) {
+		sconf = &config->servers[i];
+		if ((server = cps_worker_server(worker, sconf->id))) {
+			// replicas started later share the counters of the running ones
+			if (!sconf->sequencer) {
+				sconf->sequencer = server->sequencer;
+				sconf->connections = server->connections;
+			}
+		}
+		else if ((server = cps_server_start(worker, sconf))) {
+			TAILQ_INSERT_TAIL(&worker->servers, server, next);
+		}
+		else {
+			continue;
+		}
+		cps_server_configure(server, sconf, config);
+	}
+}
+
+
+static void _cps_config_done_cb(cps_worker_t *worker, void *_config) {
+	struct cps_config *config = (struct cps_config *)_config;
+	cps_log(config->log_level, CPS_LOG_INFO, "config reloaded");
+	cps_config_free(config);
+}
+
+
+// Applies a reloaded configuration on <worker>, and hands it on to the next
+// worker, or back to the first one to free it once all are done.
+static void _cps_config_apply_cb(cps_worker_t *worker, void *_config) {
+	struct cps_config *config = (struct cps_config *)_config;
+	cps_config_apply(worker, config);
+	if (++config->visited < g_nworkers)
+		cps_worker_call(&g_workers[config->visited], _cps_config_apply_cb, config);
+	else
+		cps_worker_call(&g_workers[0], _cps_config_done_cb, config);
+}
+
+static struct cps_defaults g_defaults;
+
+// ------------------------------------------------------------------------------------------
+// upgrade
+//
+// On SIGUSR2 the server execs its binary again (a new build, once installed)
+// and hands the new process its listening sockets over a Unix socket. When
+// the new process has started its servers on them it says so, and this one
+// stops accepting, closes its subscribers a few at a time over each server's
+// drain_timeout so that they reconnect to the new process, and exits.
+
+// A listening socket, sent as the payload of the message carrying it
+struct cps_handoff {
+	char name[256];   // of the server
+	int worker;       // whose replica listened on it
+	uint64_t seq;     // the new process numbers messages after this one
+	int fd;           // on the receiving end
+};
+
+struct cps_handoff_gather {
+	struct cps_handoff *sockets;
+	int count;
+	int visited;
+};
+
+static struct {
+	char **argv;                   // to exec the new process with
+	pid_t pid;                     // the new process, -1 while collecting sockets for it
+	int fd;                        // the Unix socket to the process on the other side
+	struct event ready_ev;
+	bool draining;
+	bool handed_over;              // once every worker has no subscribers left
+	int drained;                   // workers with no subscribers left
+	bool done[MAX_WORKERS];        // set by each worker once it has none left
+	struct event drain_ev[MAX_WORKERS];
+	int ticks, max_ticks;          // of worker 0 while draining, and the most it waits
+	struct cps_handoff *inherited; // sockets handed to this process
+	int ninherited;
+} g_upgrade = { .fd = -1 };
+
+extern char **environ;
+
+
+// Takes the sockets handed over by the process which is upgrading to this
+// one, if it passed the Unix socket to them in the environment.
+static void cps_upgrade_receive(void) {
+	const char *env = getenv(UPGRADE_FD_ENV);
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cps_handoff rec, *sockets;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t n;
 	
-	return server;
+	if (!env)
+		return;
+	g_upgrade.fd = atoi(env);
+	unsetenv(UPGRADE_FD_ENV);
+	fcntl(g_upgrade.fd, F_SETFD, FD_CLOEXEC);
+	for (;;) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &rec;
+		iov.iov_len = sizeof(rec);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if ((n = recvmsg(g_upgrade.fd, &mh, MSG_WAITALL)) == 0)
+			break;
+		if (n != sizeof(rec)) {
+			cps_warn("failed to receive the sockets of the upgraded process");
+			break;
+		}
+		if (!(cmsg = CMSG_FIRSTHDR(&mh)) || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(&rec.fd, CMSG_DATA(cmsg), sizeof(int));
+		fcntl(rec.fd, F_SETFD, FD_CLOEXEC);
+		rec.name[sizeof(rec.name) - 1] = '\0';
+		if (!(sockets = realloc(g_upgrade.inherited, (g_upgrade.ninherited + 1) * sizeof(struct cps_handoff)))) {
+			close(rec.fd);
+			continue;
+		}
+		g_upgrade.inherited = sockets;
+		g_upgrade.inherited[g_upgrade.ninherited++] = rec;
+	}
 }
 
 
-void cps_sub_delete(cps_sub_t *sub) {
+// Returns the socket handed over for <worker>'s replica of server <name>, or
+// -1 if there is none, and the last sequence number the server gave out.
+static int cps_upgrade_take(const char *name, int worker, uint64_t *seq) {
+	struct cps_handoff *rec;
+	int i, fd;
+	for (i = 0; i < g_upgrade.ninherited; i++) {
+		rec = &g_upgrade.inherited[i];
+		if (rec->fd != -1 && rec->worker == worker && strcmp(rec->name, name) == 0) {
+			fd = rec->fd;
+			rec->fd = -1;
+			*seq = rec->seq;
+			return fd;
+		}
+	}
+	return -1;
 }
 
 
-void cps_channel_delete(cps_channel_t *ch) {
-	cps_sub_t *sub;
-	TAILQ_FOREACH(sub, &ch->subs, next) {
-		cps_sub_delete(sub);
-		// hm... is this safe while traversing the tailq?
-		//TAILQ_REMOVE(&sub->channel->subs, sub, next);
-		free(sub);
+// Tells the process which is upgrading to this one that its servers have
+// started, so it can stop accepting. Sockets which no server took (for a
+// server no longer configured, or a worker which is gone) are closed.
+static void cps_upgrade_ready(void) {
+	int i;
+	if (g_upgrade.fd == -1)
+		return;
+	for (i = 0; i < g_upgrade.ninherited; i++) {
+		if (g_upgrade.inherited[i].fd != -1) {
+			cps_warn("closing the socket handed over for %s (worker %d) -- not used",
+				g_upgrade.inherited[i].name, g_upgrade.inherited[i].worker);
+			close(g_upgrade.inherited[i].fd);
+		}
 	}
-	evhttp_del_cb(ch->server->http, ch->uri);
-	free(ch->name);
-	free(ch->uri);
-	if (ch->pubkey)
-		free(ch->pubkey);
+	free(g_upgrade.inherited);
+	g_upgrade.inherited = NULL;
+	g_upgrade.ninherited = 0;
+	if (write(g_upgrade.fd, "r", 1) != 1)
+		cps_warn("failed to tell the upgraded process we are ready");
+	close(g_upgrade.fd);
+	g_upgrade.fd = -1;
 }
 
 
-void cps_server_delete(cps_server_t *server) {
+// Closes a share of the subscribers left on <server>, so that all are gone by
+// drain_until and their reconnects are spread over the drain period. Returns
+// how many are left.
+static int cps_server_drain(cps_server_t *server) {
 	cps_channel_t *ch;
+	cps_sub_t *sub, *next;
+	uint64_t ticks;
+	int left = 0, count;
+	
+	TAILQ_FOREACH(ch, &server->channels, next)
+		left += ch->nsubs;
+	if (left == 0)
+		return 0;
+	ticks = server->drain_until > server->wheel.now ? server->drain_until - server->wheel.now : 1;
+	count = (int)((left + ticks - 1) / ticks);
 	TAILQ_FOREACH(ch, &server->channels, next) {
-		cps_channel_delete(ch);
-		// hm... is this safe while traversing the tailq?
-		//TAILQ_REMOVE(&sub->channel->subs, sub, next);
-		free(ch);
+		for (sub = TAILQ_FIRST(&ch->subs); sub && count > 0; sub = next) {
+			next = TAILQ_NEXT(sub, next);
+			if (sub->ws_closing)
+				continue;
+			if (!sub->ws)
+				evhttp_add_header(sub->req->output_headers, "Connection", "close");
+			cps_sub_close(sub, 1001);
+			count--;
+			left--;
+		}
 	}
-	free(server->name);
-	free(server->channels_uri);
-	evhttp_free(server->http);
+	return left;
 }
 
 
-cps_channel_t *cps_channel_find(cps_server_t *server, const char *name) {
-	cps_channel_t *ch;
-	TAILQ_FOREACH(ch, &server->channels, next) {
-		if (ch->name[0] == name[0] && strcmp(ch->name, name) == 0)
-			return ch;
+static void _cps_upgrade_drain_tick_cb(int fd, short what, void *_worker) {
+	cps_worker_t *worker = (cps_worker_t *)_worker;
+	cps_server_t *server;
+	int left = 0;
+	
+	TAILQ_FOREACH(server, &worker->servers, next)
+		left += cps_server_drain(server);
+	if (left == 0 && !g_upgrade.done[worker->id]) {
+		g_upgrade.done[worker->id] = true;
+		__atomic_add_fetch(&g_upgrade.drained, 1, __ATOMIC_RELEASE);
+		if (worker->id != 0)
+			event_del(&g_upgrade.drain_ev[worker->id]);
+	}
+	// the first worker waits for the others, gives the last replies a second
+	// to be written out, and exits
+	if (worker->id == 0) {
+		g_upgrade.ticks++;
+		if (!g_upgrade.handed_over && __atomic_load_n(&g_upgrade.drained, __ATOMIC_ACQUIRE) == g_nworkers) {
+			cps_log(g_defaults.log_level, CPS_LOG_INFO, "upgrade: all subscribers handed over");
+			g_upgrade.handed_over = true;
+			if (g_upgrade.max_ticks > g_upgrade.ticks + 1000 / TIMER_TICK_MS)
+				g_upgrade.max_ticks = g_upgrade.ticks + 1000 / TIMER_TICK_MS;
+		}
+		if (g_upgrade.ticks >= g_upgrade.max_ticks) {
+			if (g_upgrade.handed_over)
+				cps_log(g_defaults.log_level, CPS_LOG_INFO, "upgrade: exiting");
+			else
+				cps_log(g_defaults.log_level, CPS_LOG_WARN, "upgrade: subscribers still closing -- exiting anyway");
+			cps_workers_stop();
+		}
 	}
-	return NULL;
 }
 
 
-cps_channel_t *cps_channel_open(cps_server_t *server, const char *name, 
-	int client_limit, const char *pubkey, int log_level)
-{
-	cps_channel_t *channel;
+// Stops accepting on <worker>'s servers and starts closing their subscribers.
+static void _cps_upgrade_drain_cb(cps_worker_t *worker, void *arg) {
+	struct timeval tick = { 0, TIMER_TICK_MS * 1000 };
+	cps_server_t *server;
+	int ticks;
 	
-	if (cps_channel_find(server, name ? name : "")) {
-		cps_server_log_warn(server, "duplicate channels '%s' -- skipping channel", name);
+	TAILQ_FOREACH(server, &worker->servers, next) {
+		if (server->bound) {
+			evhttp_del_accept_socket(server->http, server->bound);
+			server->bound = NULL;
+		}
+		ticks = server->drain_timeout * 1000 / TIMER_TICK_MS;
+		server->drain_until = server->wheel.now + (ticks > 0 ? ticks : 1);
+		if (g_nworkers > 1)
+			cps_server_log_info(server, "stopped accepting -- draining (worker %d)", worker->id);
+		else
+			cps_server_log_info(server, "stopped accepting -- draining");
+		// the first worker gives WebSockets a few seconds to finish closing
+		if (worker->id == 0 && ticks + 5000 / TIMER_TICK_MS > g_upgrade.max_ticks)
+			g_upgrade.max_ticks = ticks + 5000 / TIMER_TICK_MS;
+	}
+	event_set(&g_upgrade.drain_ev[worker->id], -1, EV_PERSIST, _cps_upgrade_drain_tick_cb, worker);
+	event_base_set(worker->base, &g_upgrade.drain_ev[worker->id]);
+	event_add(&g_upgrade.drain_ev[worker->id], &tick);
+}
+
+
+// Lets the servers number messages as they please again, after an upgrade
+// which failed. Runs on the first worker, whose replicas share their
+// sequencers with the others.
+static void cps_upgrade_resume(cps_worker_t *worker) {
+	cps_server_t *server;
+	TAILQ_FOREACH(server, &worker->servers, next)
+		__atomic_store_n(&server->sequencer->limit, 0, __ATOMIC_RELAXED);
+}
+
+
+static void _cps_upgrade_ready_cb(int fd, short what, void *arg) {
+	char c;
+	int i;
+	ssize_t n = read(fd, &c, 1);
+	close(fd);
+	g_upgrade.fd = -1;
+	if (n != 1) {
+		cps_log(g_defaults.log_level, CPS_LOG_WARN, "upgrade: new process %d exited before it was ready -- carrying on",
+			(int)g_upgrade.pid);
+		waitpid(g_upgrade.pid, NULL, WNOHANG);
+		g_upgrade.pid = 0;
+		cps_upgrade_resume(&g_workers[0]);
+		return;
+	}
+	cps_log(g_defaults.log_level, CPS_LOG_INFO, "upgrade: new process %d is ready -- handing over", (int)g_upgrade.pid);
+	g_upgrade.draining = true;
+	for (i = 0; i < g_nworkers; i++)
+		cps_worker_call(&g_workers[i], _cps_upgrade_drain_cb, NULL);
+}
+
+
+// A copy of the environment, with <var> in it instead of any earlier value
+static char **cps_upgrade_environ(const char *var) {
+	size_t n = 0, i, length = strlen(UPGRADE_FD_ENV);
+	char **envp;
+	while (environ[n])
+		n++;
+	if (!(envp = calloc(n + 2, sizeof(char *))))
 		return NULL;
+	for (i = n = 0; environ[i]; i++) {
+		if (strncmp(environ[i], UPGRADE_FD_ENV, length) != 0 || environ[i][length] != '=')
+			envp[n++] = environ[i];
 	}
+	envp[n] = (char *)var;
+	return envp;
+}
+
+
+static void cps_upgrade_send(int fd, struct cps_handoff *rec) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
 	
-	channel = calloc(1, sizeof(cps_channel_t));
-	
-	channel->name = name ? strdup(name) : "";
-	channel->server = server;
-	channel->log_level = log_level;
-	
-	if (pubkey && strlen(pubkey))
-		channel->pubkey = strdup(pubkey);
-	
-	TAILQ_INIT(&channel->subs);
-	
-	char *uri = calloc(256, 1);
-	snprintf(uri, 255, "%s%s", server->channels_uri ? server->channels_uri : "/channel/", name);
-	channel->uri = uri;
-	
-	evhttp_set_cb(server->http, channel->uri, cps_channel_request_handler, channel);
+	memset(&mh, 0, sizeof(mh));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = rec;
+	iov.iov_len = sizeof(*rec);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &rec->fd, sizeof(int));
+	if (sendmsg(fd, &mh, 0) != sizeof(*rec))
+		cps_warn("failed to hand over the socket of %s (worker %d)", rec->name, rec->worker);
+}
+
+
+// Looks <file> up in PATH like execvp does, unless it names a path already,
+// so that the new process can be started with execve.
+static int cps_upgrade_path(const char *file, char *path, size_t size) {
+	const char *dir, *end;
 	
-	TAILQ_INSERT_TAIL(&server->channels, channel, next);
+	if (strchr(file, '/'))
+		return snprintf(path, size, "%s", file) < (int)size ? 0 : -1;
+	if (!(dir = getenv("PATH")))
+		dir = "/usr/bin:/bin";
+	for (;; dir = end + 1) {
+		if (!(end = strchr(dir, ':')))
+			end = dir + strlen(dir);
+		// an empty entry is the current directory
+		if (snprintf(path, size, "%.*s%s%s", (int)(end - dir), dir, end > dir ? "/" : "", file) < (int)size
+			&& access(path, X_OK) == 0)
+		{
+			return 0;
+		}
+		if (!*end)
+			break;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+
+// Starts the new process and hands it the sockets gathered from the workers.
+static void _cps_upgrade_exec_cb(cps_worker_t *worker, void *_gather) {
+	struct cps_handoff_gather *gather = (struct cps_handoff_gather *)_gather;
+	char var[64], path[PATH_MAX], **envp = NULL;
+	int fds[2] = { -1, -1 }, i;
+	pid_t pid = -1;
 	
-	cps_channel_log_info(channel, "channel opened at %s%s%s", channel->uri,
-		channel->pubkey ? ", publish_key: " : "", channel->pubkey ? channel->pubkey : "");
+	// everything the child needs is prepared here, as it may only make
+	// async-signal-safe calls between fork and exec
+	if (cps_upgrade_path(g_upgrade.argv[0], path, sizeof(path)) == -1
+		|| socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+	{
+		fds[0] = fds[1] = -1;
+	}
+	else {
+		snprintf(var, sizeof(var), UPGRADE_FD_ENV "=%d", fds[1]);
+		if ((envp = cps_upgrade_environ(var)))
+			pid = fork();
+	}
+	if (pid == -1) {
+		cps_warn("upgrade: failed to start new process: %s", strerror(errno));
+		if (fds[0] != -1) {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		free(envp);
+		free(gather->sockets);
+		free(gather);
+		g_upgrade.pid = 0;
+		cps_upgrade_resume(worker);
+		return;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		execve(path, g_upgrade.argv, envp);
+		_exit(127);
+	}
+	free(envp);
+	close(fds[1]);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	for (i = 0; i < gather->count; i++)
+		cps_upgrade_send(fds[0], &gather->sockets[i]);
+	shutdown(fds[0], SHUT_WR);
+	cps_log(g_defaults.log_level, CPS_LOG_INFO, "upgrade: started %s (pid %d), handing over %d sockets",
+		path, (int)pid, gather->count);
+	free(gather->sockets);
+	free(gather);
 	
-	return channel;
+	g_upgrade.pid = pid;
+	g_upgrade.fd = fds[0];
+	event_set(&g_upgrade.ready_ev, fds[0], EV_READ, _cps_upgrade_ready_cb, NULL);
+	event_base_set(worker->base, &g_upgrade.ready_ev);
+	event_add(&g_upgrade.ready_ev, NULL);
 }
 
 
-//void cps_channel_close(cps_channel_t *channel) { }
+// Adds the listening sockets of <worker>'s servers to <gather>, and hands it
+// on.
+static void _cps_upgrade_collect_cb(cps_worker_t *worker, void *_gather) {
+	struct cps_handoff_gather *gather = (struct cps_handoff_gather *)_gather;
+	struct cps_handoff *sockets, *rec;
+	cps_server_t *server;
+	
+	TAILQ_FOREACH(server, &worker->servers, next) {
+		// this process may go on publishing until the new one is ready, with
+		// numbers up to the limit, and the new one starts there. The first
+		// worker sets it, for the replicas which share its sequencer.
+		if (worker->id == 0)
+			__atomic_store_n(&server->sequencer->limit,
+				cps_sequencer_last(server->sequencer) + UPGRADE_SEQ_RESERVE, __ATOMIC_RELAXED);
+		if (!server->bound
+			|| !(sockets = realloc(gather->sockets, (gather->count + 1) * sizeof(struct cps_handoff))))
+		{
+			continue;
+		}
+		gather->sockets = sockets;
+		rec = &gather->sockets[gather->count++];
+		memset(rec, 0, sizeof(*rec));
+		snprintf(rec->name, sizeof(rec->name), "%s", server->name);
+		rec->worker = worker->id;
+		rec->seq = __atomic_load_n(&server->sequencer->limit, __ATOMIC_RELAXED) - 1;
+		rec->fd = evhttp_bound_socket_get_fd(server->bound);
+	}
+	if (++gather->visited < g_nworkers)
+		cps_worker_call(&g_workers[gather->visited], _cps_upgrade_collect_cb, gather);
+	else
+		cps_worker_call(&g_workers[0], _cps_upgrade_exec_cb, gather);
+}
 
 // ------------------------------------------------------------------------------------------
 // signal handlers
@@ -363,11 +4671,60 @@ cps_channel_t *cps_channel_open(cps_server_t *server, const char *name,
 static void _sigpipe_cb(int sig, short what, void *arg) {
 }
 
-static void _reload_cb(int sig, short what, void *config) {
-	if (config)
-		yconf_reload((yconf_t *)config);
-	// todo: update state, delete/create/update servers and channels which was removed/added/modified.
-	cps_log(yconf_get_int(config, "logging/log_level", CPS_LOG_INFO), CPS_LOG_INFO, "config reloaded");
+// Has main stop the workers and write out the logs before it exits
+static void _exit_cb(int sig, short what, void *arg) {
+	cps_workers_stop();
+}
+
+// Writes out the messages logged since the last tick. The logs are written by
+// the first worker, which is the main thread, once the others are joined.
+static void cps_flush_logs(void) {
+	cps_server_t *server;
+	TAILQ_FOREACH(server, &g_workers[0].servers, next)
+		cps_server_flush_logs(server);
+}
+
+// Starts a new process on the listening sockets of this one, which then hands
+// over its subscribers and exits.
+static void _upgrade_cb(int sig, short what, void *arg) {
+	struct cps_handoff_gather *gather;
+	if (g_upgrade.pid || g_upgrade.draining) {
+		cps_log(g_defaults.log_level, CPS_LOG_WARN, "upgrade already in progress");
+		return;
+	}
+	if (!(gather = calloc(1, sizeof(struct cps_handoff_gather))))
+		return;
+	g_upgrade.pid = -1;
+	cps_worker_call(&g_workers[0], _cps_upgrade_collect_cb, gather);
+}
+
+// Reads the configuration file again and has the workers apply it, one after
+// the other. If the file can not be read, or configures no servers, the
+// running configuration is kept.
+static void _reload_cb(int sig, short what, void *_config) {
+	yconf_t *config = (yconf_t *)_config;
+	struct cps_config *conf;
+	
+	if (g_upgrade.pid || g_upgrade.draining) {
+		cps_log(g_defaults.log_level, CPS_LOG_WARN, "upgrade in progress -- not reloading");
+		return;
+	}
+	if (yconf_reload(config) != 0) {
+		cps_log(g_defaults.log_level, CPS_LOG_WARN, "failed to reload %s -- keeping the running configuration",
+			config->filename);
+		return;
+	}
+	if (!(conf = cps_config_read(config, &g_defaults)))
+		return;
+	if (conf->nservers == 0) {
+		cps_log(conf->log_level, CPS_LOG_WARN, "no servers in %s -- keeping the running configuration",
+			config->filename);
+		cps_config_free(conf);
+		return;
+	}
+	if (yconf_get_int(config, "workers", g_nworkers) != g_nworkers)
+		cps_log(conf->log_level, CPS_LOG_WARN, "the number of workers only changes on restart");
+	cps_worker_call(&g_workers[0], _cps_config_apply_cb, conf);
 }
 
 // ------------------------------------------------------------------------------------------
@@ -379,9 +4736,17 @@ void usage(const char *progname, bool full) {
 	"  -a <addr>    Address to bind on (defaults to 127.0.0.1).\n"
 	"  -p <port>    Port number to listen on (defaults to 8080).\n"
 	"  -c <channel> Channel name (defaults to \"default\").\n"
+	"  -D           Create any channel requested under /channel/ on first use\n"
+	"                and close it again once it has been idle for a minute.\n"
 	"  -k <secret>  Only allow publishing of requests with this key in\n"
 	"                the header field \"X-CPS-Publish-Key: <secret>\".\n"
 	"  -f <file>    Read configuration from YAML file.\n"
+	"  -t <secs>    Answer long-polling subscribers which got no message\n"
+	"                within this time with 204 (defaults to 30, 0 waits forever).\n"
+	"  -m <count>   Answer subscribers with 503 while this many are connected\n"
+	"                (defaults to 0, no limit).\n"
+	"  -w <count>   Number of event loop threads (defaults to 1). Each thread\n"
+	"                accepts its own connections through SO_REUSEPORT.\n"
 	"  -v           Verbose (multiple times for more logging).\n"
 	"  -s           Silent (multiple times for less logging).\n"
 	,progname,(full ? "Long-polling JSONP comet server.\n\noptions:\n" : ""));
@@ -392,6 +4757,7 @@ void usage(const char *progname, bool full) {
 	
 	"  Example file:\n\n"
 	
+	"  workers: 4\n"
 	"  servers:\n"
 	"    - address: \"0.0.0.0\"\n"
 	"      port: 8080\n"
@@ -405,6 +4771,10 @@ void usage(const char *progname, bool full) {
 	"      address: \"localhost\"\n"
 	"      log_level: 2\n"
 	"      channels: {a: {publish_key: xyz}, b: {}}\n"
+	"      dynamic_channels:\n"
+	"        publish_key: xyz\n"
+	"        idle_timeout: 60\n"
+	"        max_channels: 100000\n"
 	"\n"
 	"By Rasmus Andersson <http://hunch.se/>, open source licensed under MIT.\n"
 		);
@@ -418,12 +4788,14 @@ void usage(const char *progname, bool full) {
 int main(int argc, char **argv) {
 	extern char		     *optarg;
 	extern int		     optind;
-	struct event	     pipe_ev, usr1_ev;
-	int						     c, log_level = CPS_LOG_INFO;
-	bool               configured_servers;
+	struct event	     pipe_ev, usr1_ev, usr2_ev, int_ev, term_ev;
+	struct event_base  *base;
+	int						     c, i, log_level = CPS_LOG_INFO, workers = 0;
+	int                poll_timeout = DEFAULT_POLL_TIMEOUT, max_connections = 0;
+	int                log_buffer = DEFAULT_LOG_BUFFER;
+	bool               dynamic_channels = false;
 	yconf_t	           config;
-	struct cps_servers servers;
-	cps_server_t       *server;
+	struct cps_config  *conf;
 	
 	short			 http_port = 8080;
 	char			 *http_addr = "127.0.0.1";
@@ -432,7 +4804,8 @@ int main(int argc, char **argv) {
 	const char *channel_name = "default";
 	const char *docroot = NULL;
 
-	while ((c = getopt(argc, argv, "hvsp:l:k:f:c:d:")) != -1) switch(c) {
+	g_upgrade.argv = argv;
+	while ((c = getopt(argc, argv, "hvsp:l:k:f:c:d:w:t:Dm:")) != -1) switch(c) {
 		case 'v':
 			log_level++;
 			break;
@@ -457,10 +4830,30 @@ int main(int argc, char **argv) {
 			break;
 		case 'c':
 			channel_name = optarg;
+			if (!cps_channel_name_valid(channel_name, false)) {
+				fprintf(stderr, "invalid channel name '%s'\n", channel_name);
+				exit(1);
+			}
 			break;
 		case 'd':
 			docroot = optarg;
 			break;
+		case 't':
+			poll_timeout = atoi(optarg);
+			break;
+		case 'D':
+			dynamic_channels = true;
+			break;
+		case 'm':
+			max_connections = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > MAX_WORKERS) {
+				usage(argv[0], false);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(argv[0], true);
 			exit(1);
@@ -472,12 +4865,15 @@ int main(int argc, char **argv) {
 	argv += optind;
 	
 	/* init libevent */
-	event_init();
+	base = event_init();
 	
 	// load configuration file
 	if (config_file) {
-		yconf_load(&config, config_file);
-		log_level += 1 - (int)yconf_get_int(&config, "log_level", (long long)log_level);
+		if (yconf_load(&config, config_file) != 0) {
+			fprintf(stderr, "failed to load %s\n", config_file);
+			exit(1);
+		}
+		log_buffer = (int)yconf_get_int(&config, "log_buffer", log_buffer);
 		//printf("config: servers/0/address => %s\n",
 		//	yconf_get_str(&config, "servers/0/address", "?"));
 		//printf("config: servers/1/channels/test2/max_clients => %lld\n",
@@ -486,6 +4882,20 @@ int main(int argc, char **argv) {
 		signal_add(&usr1_ev, NULL);
 	}
 
+	/* write the log from a background thread (0 lines writes it right away) */
+	if (log_buffer > 0 && logring_start(STDERR_FILENO, (size_t)log_buffer) != 0)
+		cps_warn("failed to start log thread -- logging synchronously");
+	
+	/* start event loop workers (the main thread is worker 0) */
+	if (workers == 0)
+		workers = config_file ? (int)yconf_get_int(&config, "workers", 1) : 1;
+	if (workers < 1 || workers > MAX_WORKERS) {
+		fprintf(stderr, "workers must be between 1 and %d\n", MAX_WORKERS);
+		exit(1);
+	}
+	if (cps_workers_init(base, workers) != 0)
+		exit(1);
+	
 	/* remove soft resource limits */
 	struct rlimit rlim = { RLIM_INFINITY, RLIM_INFINITY };
 	setrlimit(RLIMIT_NOFILE, &rlim);
@@ -493,48 +4903,49 @@ int main(int argc, char **argv) {
 	/* ignore SIGPIPE (broken connections) */
 	signal_set(&pipe_ev, SIGPIPE, _sigpipe_cb, NULL);
 	signal_add(&pipe_ev, NULL);
+	signal_set(&int_ev, SIGINT, _exit_cb, NULL);
+	signal_add(&int_ev, NULL);
+	signal_set(&term_ev, SIGTERM, _exit_cb, NULL);
+	signal_add(&term_ev, NULL);
+	signal_set(&usr2_ev, SIGUSR2, _upgrade_cb, NULL);
+	signal_add(&usr2_ev, NULL);
 	
-	TAILQ_INIT(&servers);
-	
-	// start server(s) from config
-	configured_servers = false;
-	if (config_file) {
-		yaml_node_t *srvs, *srv;
-		// servers
-		if ((srvs = yconf_find_node(&config, "servers", true)) && srvs->type == YAML_SEQUENCE_NODE) {
-			yconf_list_foreach(&config, srvs, srv) {
-				server = cps_server_start(
-					yconf_get_str2(&config, srv, "address", http_addr),
-					(int)yconf_get_int2(&config, srv, "port", http_port),
-					(int)yconf_get_int2(&config, srv, "log_level", log_level)
-				);
-				
-				// channels
-				yaml_node_t *chnls, *chname, *chnl;
-				if ((chnls = yconf_find_node2(&config, srv, "channels", true)) && chnls->type == YAML_MAPPING_NODE) {
-					yconf_map_foreach(&config, chnls, chname, chnl) {
-						cps_channel_open(server,
-							(const char *)chname->data.scalar.value,
-							(int)yconf_get_int2(&config, chnl, "max_clients", 0),
-							yconf_get_str2(&config, chnl, "publish_key", NULL),
-							(int)yconf_get_int2(&config, chnl, "log_level", log_level)
-						);
-					}
-				}
-				
-				configured_servers = true;
-			}
-		}
-	}
+	/* take over the listening sockets of the process upgrading to this one */
+	cps_upgrade_receive();
 	
-	// start server from args if no servers was configured in config
-	if (!configured_servers) {
-		server = cps_server_start(http_addr, http_port, log_level);
-		TAILQ_INSERT_TAIL(&servers, server, next);
-		cps_channel_open(server, channel_name, 0, pubkey, log_level);
+	// start server(s) from config, or from args if no servers was configured
+	g_defaults.address = http_addr;
+	g_defaults.port = http_port;
+	g_defaults.log_level = log_level;
+	g_defaults.poll_timeout = poll_timeout;
+	g_defaults.max_connections = max_connections;
+	g_defaults.pubkey = pubkey;
+	g_defaults.channel = channel_name;
+	g_defaults.dynamic = dynamic_channels;
+	conf = config_file ? cps_config_read(&config, &g_defaults) : NULL;
+	if (conf && conf->nservers == 0) {
+		cps_config_free(conf);
+		conf = NULL;
 	}
+	if (!conf && !(conf = cps_config_from_args(&g_defaults)))
+		exit(1);
+	// one replica of each server per worker
+	for (i = 0; i < g_nworkers; i++)
+		cps_config_apply(&g_workers[i], conf);
+	cps_config_free(conf);
+	if (TAILQ_EMPTY(&g_workers[0].servers))
+		exit(1);
+	cps_upgrade_ready();
 	
+	cps_workers_run();
 	event_dispatch();
-	yconf_delete(&config);
-	exit(0);
+	// left through cps_workers_stop; with the other workers gone, nothing
+	// touches the channels and their logs any more
+	cps_workers_join();
+	cps_flush_logs();
+	// the last thread which logs is this one, so the ring can be drained
+	logring_stop();
+	if (config_file)
+		yconf_delete(&config);
+	return 0;
 }
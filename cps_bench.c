@@ -0,0 +1,386 @@
+/*
+cps_bench - Load generator for a running cometpsd. Opens long-polling and
+streaming (Server-Sent Events) subscribers spread over a number of channels,
+publishes to those channels at a fixed rate, and reports publish-to-delivery
+latency percentiles, messages delivered and reconnects per second, and the
+resident size of the server.
+
+Channels are named bench.0, bench.1, ... so the server needs to create them on
+demand (-D, or a dynamic_channels section). Each message carries the time it
+was published, so latency is measured on the same clock it was taken with.
+
+usage: cps_bench [-a address] [-p port] [-n subscribers] [-m channels]
+                 [-s percent streaming] [-r messages/s] [-d seconds]
+                 [-k publish key] [-P server pid]
+*/
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <event.h>
+#include <evhttp.h>
+
+#define PUBLISHERS 4         // connections publishes are spread over
+#define WARMUP_SECONDS 1     // for subscribers to connect before publishing starts
+#define DRAIN_SECONDS 2      // for the last messages to arrive after it stops
+#define RETRY_SECONDS 1      // before a subscriber whose request failed tries again
+
+typedef struct bench_sub {
+	struct evhttp_connection *evcon;
+	int channel;
+	bool stream;
+	uint64_t since;           // last seq seen, to resume from
+	struct evbuffer *partial; // incomplete event stream lines
+	struct event retry_ev;
+} bench_sub_t;
+
+static struct event_base *g_base;
+static const char *g_address = "127.0.0.1";
+static int g_port = 8080;
+static int g_nsubs = 1000;
+static int g_nchannels = 10;
+static int g_stream_percent = 50;
+static int g_rate = 100;
+static int g_duration = 10;
+static const char *g_pubkey;
+static pid_t g_server_pid;
+
+static bench_sub_t *g_subs;
+static struct evhttp_connection *g_publishers[PUBLISHERS];
+static struct event g_publish_ev, g_report_ev;
+static uint64_t g_started, g_publish_until;
+static int g_next_channel;
+
+static uint64_t g_published, g_publish_errors, g_delivered, g_reconnects, g_errors;
+static uint64_t g_last_delivered, g_last_reconnects;
+static uint32_t *g_latencies;  // microseconds
+static size_t g_nlatencies, g_latencies_size;
+
+
+static uint64_t _now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Records the delivery of a message published at <published> (in microseconds).
+static void record(uint64_t published) {
+	uint64_t latency;
+	if (published == 0)
+		return;
+	latency = _now_us() - published;
+	if (g_nlatencies == g_latencies_size) {
+		size_t size = g_latencies_size ? g_latencies_size * 2 : 65536;
+		uint32_t *latencies = realloc(g_latencies, size * sizeof(uint32_t));
+		if (!latencies)
+			return;
+		g_latencies = latencies;
+		g_latencies_size = size;
+	}
+	g_latencies[g_nlatencies++] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+	g_delivered++;
+}
+
+
+static void sub_request(bench_sub_t *sub);
+
+static void _sub_retry_cb(int fd, short what, void *_sub) {
+	sub_request((bench_sub_t *)_sub);
+}
+
+
+static void sub_retry(bench_sub_t *sub) {
+	struct timeval tv = { RETRY_SECONDS, 0 };
+	g_errors++;
+	event_add(&sub->retry_ev, &tv);
+}
+
+
+// A long-poll response holds one or more "cb(<published>, <seq>);" calls.
+static void _sub_poll_done_cb(struct evhttp_request *req, void *_sub) {
+	bench_sub_t *sub = (bench_sub_t *)_sub;
+	struct evbuffer *buf;
+	unsigned long long published, seq;
+	const char *p;
+
+	if (!req || evhttp_request_get_response_code(req) == 0) {
+		sub_retry(sub);
+		return;
+	}
+	if (evhttp_request_get_response_code(req) == 200) {
+		buf = evhttp_request_get_input_buffer(req);
+		evbuffer_add(buf, "", 1);
+		for (p = (const char *)evbuffer_pullup(buf, -1); (p = strstr(p, "cb(")); p++) {
+			if (sscanf(p, "cb(%llu, %llu)", &published, &seq) == 2) {
+				record(published);
+				sub->since = seq;
+			}
+		}
+	}
+	g_reconnects++;
+	sub_request(sub);
+}
+
+
+// Event stream chunks may end anywhere, so complete lines are parsed as they
+// come in and the rest is kept for the next chunk.
+static void _sub_stream_chunk_cb(struct evhttp_request *req, void *_sub) {
+	bench_sub_t *sub = (bench_sub_t *)_sub;
+	char *line;
+
+	evbuffer_add_buffer(sub->partial, evhttp_request_get_input_buffer(req));
+	while ((line = evbuffer_readln(sub->partial, NULL, EVBUFFER_EOL_LF))) {
+		if (strncmp(line, "id: ", 4) == 0)
+			sub->since = strtoull(line + 4, NULL, 10);
+		else if (strncmp(line, "data: ", 6) == 0)
+			record(strtoull(line + 6, NULL, 10));
+		free(line);
+	}
+}
+
+
+static void _sub_stream_done_cb(struct evhttp_request *req, void *_sub) {
+	bench_sub_t *sub = (bench_sub_t *)_sub;
+	evbuffer_drain(sub->partial, evbuffer_get_length(sub->partial));
+	if (!req || evhttp_request_get_response_code(req) == 0) {
+		sub_retry(sub);
+		return;
+	}
+	g_reconnects++;
+	sub_request(sub);
+}
+
+
+static void sub_request(bench_sub_t *sub) {
+	struct evhttp_request *req;
+	char uri[128];
+
+	if (sub->stream) {
+		req = evhttp_request_new(_sub_stream_done_cb, sub);
+		evhttp_request_set_chunked_cb(req, _sub_stream_chunk_cb);
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Accept", "text/event-stream");
+		snprintf(uri, sizeof(uri), "/channel/bench.%d", sub->channel);
+		if (sub->since) {
+			char since[24];
+			snprintf(since, sizeof(since), "%llu", (unsigned long long)sub->since);
+			evhttp_add_header(evhttp_request_get_output_headers(req), "Last-Event-ID", since);
+		}
+	}
+	else {
+		req = evhttp_request_new(_sub_poll_done_cb, sub);
+		if (sub->since) {
+			snprintf(uri, sizeof(uri), "/channel/bench.%d?jsonp=cb&since=%llu", sub->channel,
+				(unsigned long long)sub->since);
+		}
+		else {
+			snprintf(uri, sizeof(uri), "/channel/bench.%d?jsonp=cb", sub->channel);
+		}
+	}
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Host", g_address);
+	if (evhttp_make_request(sub->evcon, req, EVHTTP_REQ_GET, uri) != 0)
+		sub_retry(sub);
+}
+
+
+static void _publish_done_cb(struct evhttp_request *req, void *arg) {
+	int code = req ? evhttp_request_get_response_code(req) : 0;
+	if (code != 200 && code != 204)
+		g_publish_errors++;
+}
+
+
+static void publish(void) {
+	struct evhttp_connection *evcon = g_publishers[g_published % PUBLISHERS];
+	struct evhttp_request *req = evhttp_request_new(_publish_done_cb, NULL);
+	char uri[64];
+
+	snprintf(uri, sizeof(uri), "/channel/bench.%d", g_next_channel);
+	g_next_channel = (g_next_channel + 1) % g_nchannels;
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Host", g_address);
+	if (g_pubkey)
+		evhttp_add_header(evhttp_request_get_output_headers(req), "X-CPS-Publish-Key", g_pubkey);
+	evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%llu", (unsigned long long)_now_us());
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_POST, uri) != 0)
+		g_publish_errors++;
+	g_published++;
+}
+
+
+// Publishes whatever is due by now, so the rate holds however late the timer
+// fires.
+static void _publish_cb(int fd, short what, void *arg) {
+	uint64_t now = _now_us(), start = g_started + WARMUP_SECONDS * 1000000ULL;
+	uint64_t due;
+
+	if (now >= g_publish_until) {
+		event_del(&g_publish_ev);
+		return;
+	}
+	if (now < start)
+		return;
+	due = (now - start) * g_rate / 1000000 + 1;
+	while (g_published < due)
+		publish();
+}
+
+
+// Reads a "Vm...:" line of /proc/<pid>/status, in kB.
+static long server_memory(const char *field) {
+	char path[64], line[128];
+	size_t length = strlen(field);
+	long kb = -1;
+	FILE *f;
+
+	if (!g_server_pid)
+		return -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)g_server_pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, field, length) == 0 && line[length] == ':') {
+			kb = atol(line + length + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+
+static void _report_cb(int fd, short what, void *arg) {
+	uint64_t now = _now_us();
+	long rss = server_memory("VmRSS");
+
+	printf("%5.1fs  published %8llu  delivered %8llu/s  reconnects %7llu/s",
+		(now - g_started) / 1e6, (unsigned long long)g_published,
+		(unsigned long long)(g_delivered - g_last_delivered),
+		(unsigned long long)(g_reconnects - g_last_reconnects));
+	if (rss >= 0)
+		printf("  server rss %6ld kB", rss);
+	printf("\n");
+	fflush(stdout);
+	g_last_delivered = g_delivered;
+	g_last_reconnects = g_reconnects;
+	if (now >= g_publish_until + DRAIN_SECONDS * 1000000ULL)
+		event_base_loopexit(g_base, NULL);
+}
+
+
+static int _cmp_latency(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+static double percentile(double p) {
+	size_t i = (size_t)(p / 100.0 * g_nlatencies);
+	if (i >= g_nlatencies)
+		i = g_nlatencies - 1;
+	return g_latencies[i] / 1000.0;
+}
+
+
+static void summary(void) {
+	int nstreams = g_nsubs * g_stream_percent / 100;
+	uint64_t expected = g_published * g_nsubs / g_nchannels;
+
+	printf("\n%d subscribers (%d long-polling, %d streaming) on %d channels, %d messages/s for %ds\n",
+		g_nsubs, g_nsubs - nstreams, nstreams, g_nchannels, g_rate, g_duration);
+	printf("  published    %llu (%llu failed)\n", (unsigned long long)g_published,
+		(unsigned long long)g_publish_errors);
+	printf("  delivered    %llu of about %llu, %.0f messages/s\n", (unsigned long long)g_delivered,
+		(unsigned long long)expected, (double)g_delivered / g_duration);
+	printf("  reconnects   %.0f/s (%llu failed requests)\n", (double)g_reconnects / g_duration,
+		(unsigned long long)g_errors);
+	if (g_nlatencies > 0) {
+		qsort(g_latencies, g_nlatencies, sizeof(uint32_t), _cmp_latency);
+		printf("  latency ms   p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+			percentile(50), percentile(90), percentile(99), percentile(99.9),
+			g_latencies[g_nlatencies - 1] / 1000.0);
+	}
+	if (g_server_pid) {
+		printf("  server rss   %ld kB (peak %ld kB)\n", server_memory("VmRSS"), server_memory("VmHWM"));
+	}
+}
+
+
+static void usage(const char *progname) {
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-n subscribers] [-m channels]\n"
+		"       [-s percent streaming] [-r messages/s] [-d seconds] [-k publish key] [-P server pid]\n",
+		progname);
+}
+
+
+int main(int argc, char **argv) {
+	struct timeval tick = { 0, 1000 }, second = { 1, 0 }, warmup = { WARMUP_SECONDS, 0 };
+	struct rlimit rl;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "a:p:n:m:s:r:d:k:P:h")) != -1) switch (c) {
+		case 'a': g_address = optarg; break;
+		case 'p': g_port = atoi(optarg); break;
+		case 'n': g_nsubs = atoi(optarg); break;
+		case 'm': g_nchannels = atoi(optarg); break;
+		case 's': g_stream_percent = atoi(optarg); break;
+		case 'r': g_rate = atoi(optarg); break;
+		case 'd': g_duration = atoi(optarg); break;
+		case 'k': g_pubkey = optarg; break;
+		case 'P': g_server_pid = (pid_t)atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			exit(1);
+	}
+	if (g_port <= 0 || g_nsubs < 0 || g_nchannels < 1 || g_stream_percent < 0 || g_stream_percent > 100
+		|| g_rate < 1 || g_duration < 1)
+	{
+		usage(argv[0]);
+		exit(1);
+	}
+
+	// one socket per subscriber
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	g_base = event_base_new();
+	g_subs = calloc(g_nsubs, sizeof(bench_sub_t));
+	for (i = 0; i < g_nsubs; i++) {
+		bench_sub_t *sub = &g_subs[i];
+		sub->evcon = evhttp_connection_base_new(g_base, NULL, g_address, g_port);
+		evhttp_connection_set_timeout(sub->evcon, 3600);
+		sub->channel = i % g_nchannels;
+		sub->stream = i < g_nsubs * g_stream_percent / 100;
+		sub->partial = evbuffer_new();
+		event_set(&sub->retry_ev, -1, 0, _sub_retry_cb, sub);
+		event_base_set(g_base, &sub->retry_ev);
+		sub_request(sub);
+	}
+	for (i = 0; i < PUBLISHERS; i++)
+		g_publishers[i] = evhttp_connection_base_new(g_base, NULL, g_address, g_port);
+
+	g_started = _now_us();
+	g_publish_until = g_started + (WARMUP_SECONDS + g_duration) * 1000000ULL;
+	event_set(&g_publish_ev, -1, EV_PERSIST, _publish_cb, NULL);
+	event_base_set(g_base, &g_publish_ev);
+	event_set(&g_report_ev, -1, EV_PERSIST, _report_cb, NULL);
+	event_base_set(g_base, &g_report_ev);
+	event_add(&g_report_ev, &second);
+
+	// publishing starts once the subscribers had a moment to connect
+	event_base_loopexit(g_base, &warmup);
+	event_base_dispatch(g_base);
+	event_add(&g_publish_ev, &tick);
+	event_base_dispatch(g_base);
+
+	summary();
+	return g_published > 0 && g_delivered > 0 ? 0 : 1;
+}
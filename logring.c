@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logring.h"
+
+#define LOGRING_BATCH (64 * 1024)  // bytes written out at once
+#define LOGRING_IDLE_MS 10          // how often an empty ring is looked at
+
+// A slot holds a line once its <seq> is one past the position it was claimed
+// for, and is free for the position one lap later once the line was taken.
+struct logring_slot {
+	unsigned long seq;
+	size_t length;
+	char line[LOGRING_LINE];
+};
+
+static struct {
+	struct logring_slot *slots;
+	size_t mask;
+	int fd;
+	bool running;
+	pthread_t thread;
+	unsigned long head;       // next position to take, only touched by the background thread
+	unsigned long reported;   // drops written to the log so far
+	unsigned long dropped;
+	unsigned long tail __attribute__((aligned(64))); // next position to claim
+} g_ring = { .fd = 2 };
+
+static char g_batch[LOGRING_BATCH];
+
+
+static void _logring_write(const char *buf, size_t length) {
+	ssize_t n;
+	while (length > 0) {
+		if ((n = write(g_ring.fd, buf, length)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		length -= n;
+	}
+}
+
+
+// Formats a line into <line>, cutting it short (but keeping its line break)
+// if it does not fit. Returns its length.
+static size_t _logring_format(char *line, const char *fmt, va_list ap) {
+	int n = vsnprintf(line, LOGRING_LINE, fmt, ap);
+	if (n < 0)
+		return 0;
+	if (n >= LOGRING_LINE) {
+		line[LOGRING_LINE - 2] = '\n';
+		return LOGRING_LINE - 1;
+	}
+	return (size_t)n;
+}
+
+
+// Writes out the lines in the ring, and the number of lines dropped since the
+// last time if there were any. Returns the number of lines taken.
+static size_t _logring_drain(void) {
+	struct logring_slot *slot;
+	unsigned long dropped;
+	size_t length = 0, count = 0;
+
+	for (;;) {
+		slot = &g_ring.slots[g_ring.head & g_ring.mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_ring.head + 1)
+			break;
+		if (length + slot->length > sizeof(g_batch)) {
+			_logring_write(g_batch, length);
+			length = 0;
+		}
+		memcpy(g_batch + length, slot->line, slot->length);
+		length += slot->length;
+		__atomic_store_n(&slot->seq, g_ring.head + g_ring.mask + 1, __ATOMIC_RELEASE);
+		g_ring.head++;
+		count++;
+	}
+	dropped = __atomic_load_n(&g_ring.dropped, __ATOMIC_RELAXED);
+	if (dropped != g_ring.reported) {
+		if (length + 64 > sizeof(g_batch)) {
+			_logring_write(g_batch, length);
+			length = 0;
+		}
+		length += snprintf(g_batch + length, 64, "W log: %lu lines dropped\n", dropped - g_ring.reported);
+		g_ring.reported = dropped;
+	}
+	if (length > 0)
+		_logring_write(g_batch, length);
+	return count;
+}
+
+
+static void *_logring_main(void *arg) {
+	struct timespec idle = { 0, LOGRING_IDLE_MS * 1000000 };
+	bool stopping;
+	for (;;) {
+		// lines pushed before the stop was seen are still written
+		stopping = !__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE);
+		if (_logring_drain() == 0) {
+			if (stopping)
+				break;
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+
+int logring_start(int fd, size_t slots) {
+	size_t size = 1, i;
+
+	if (g_ring.running)
+		return 0;
+	while (size < slots)
+		size <<= 1;
+	if (!(g_ring.slots = malloc(size * sizeof(struct logring_slot))))
+		return -1;
+	for (i = 0; i < size; i++)
+		g_ring.slots[i].seq = i;
+	g_ring.mask = size - 1;
+	g_ring.head = g_ring.tail = 0;
+	g_ring.fd = fd;
+	g_ring.running = true;
+	if (pthread_create(&g_ring.thread, NULL, _logring_main, NULL) != 0) {
+		g_ring.running = false;
+		free(g_ring.slots);
+		g_ring.slots = NULL;
+		return -1;
+	}
+	atexit(logring_stop);
+	return 0;
+}
+
+
+void logring_stop(void) {
+	if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&g_ring.running, false, __ATOMIC_RELEASE);
+	pthread_join(g_ring.thread, NULL);
+}
+
+
+void logring_printf(const char *fmt, ...) {
+	struct logring_slot *slot;
+	unsigned long pos, seq;
+	char line[LOGRING_LINE];
+	va_list ap;
+	long diff;
+
+	if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE)) {
+		va_start(ap, fmt);
+		_logring_write(line, _logring_format(line, fmt, ap));
+		va_end(ap);
+		return;
+	}
+
+	// claim the slot at the tail, unless the background thread has yet to take
+	// the line which was put there one lap ago
+	pos = __atomic_load_n(&g_ring.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &g_ring.slots[pos & g_ring.mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&g_ring.tail, &pos, pos + 1, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0) {
+			__atomic_add_fetch(&g_ring.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else {
+			pos = __atomic_load_n(&g_ring.tail, __ATOMIC_RELAXED);
+		}
+	}
+	va_start(ap, fmt);
+	slot->length = _logring_format(slot->line, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+unsigned long logring_dropped(void) {
+	return __atomic_load_n(&g_ring.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+#ifndef _LOGRING_H_
+#define _LOGRING_H_
+
+#include <stddef.h>
+
+// Asynchronous log output. Any thread formats its line into a slot of a
+// bounded lock-free ring and goes on; a background thread takes the lines in
+// order and writes them out in batches, so a slow reader of the log (a pipe
+// to a log shipper, a terminal) only ever holds up that thread. When the ring
+// is full, lines are dropped rather than waited for, and counted; the count
+// is written to the log once there is room again.
+//
+// Until logring_start is called, and after logring_stop, lines are written
+// right away.
+
+#define LOGRING_LINE 512  // longer lines are cut short
+
+// Starts writing to <fd> through a ring of <slots> lines (rounded up to a
+// power of two). Returns 0, or -1 if the ring or thread could not be set up,
+// in which case lines keep being written right away. logring_stop is called
+// at exit, unless it was called before.
+int logring_start(int fd, size_t slots);
+
+// Writes out every line still in the ring and stops the background thread.
+// Lines logged meanwhile by other threads may be lost, so it is to be called
+// once they are done logging.
+void logring_stop(void);
+
+void logring_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Lines dropped so far for lack of room
+unsigned long logring_dropped(void);
+
+#endif
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <zlib.h>
+
+#include "msglog.h"
+
+#define MSGLOG_MAGIC 0x4d535043    // "CPSM"
+#define MSGLOG_BATCH (64 * 1024)   // buffered bytes which are written out right away
+#define MSGLOG_PAD(n) (((n) + 7) & ~(size_t)7)
+
+// Every message is a record header and its payload, padded so that the next
+// header is aligned again.
+struct msglog_rec {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t seq;
+	int64_t time;
+	uint32_t crc;      // of the payload
+	uint32_t unused;
+};
+
+struct msglog_seg {
+	TAILQ_ENTRY(msglog_seg) next;
+	char *path;
+	uint64_t first;    // sequence number it is named after
+	char *map;
+	size_t mapped;
+	size_t size;       // bytes of whole records written, read by replay without the lock
+	time_t newest;     // of its newest message
+	int refcount;      // the log's, and one for every reference to its mapping
+};
+TAILQ_HEAD(msglog_segs, msglog_seg);
+
+struct msglog {
+	char *dir;
+	size_t segment_size;
+	size_t max_bytes;
+	int max_age;
+	pthread_mutex_t lock;        // held while replaying, and while segments or the buffer change
+	struct msglog_segs segs;     // oldest first
+	size_t bytes;                // in all segments
+	uint64_t last_seq;
+	struct msglog_seg *active;   // written to, NULL until the first message after opening
+	int fd;
+	char *buf;                   // records not yet written out, replayed from here meanwhile
+	size_t buflen;
+	size_t bufsize;
+	time_t bufnewest;
+};
+
+
+static int msglog_mkdirs(const char *dir) {
+	char path[4096], *p;
+	if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	for (p = path + 1; ; p++) {
+		if (*p == '/' || *p == '\0') {
+			char c = *p;
+			*p = '\0';
+			if (mkdir(path, 0755) == -1 && errno != EEXIST)
+				return -1;
+			if (!(*p = c))
+				break;
+		}
+	}
+	return 0;
+}
+
+
+// Returns the length of the whole, intact records at the start of <map>.
+static size_t msglog_scan(const char *map, size_t size, uint64_t *last_seq, time_t *newest) {
+	const struct msglog_rec *rec;
+	size_t off = 0, reclen;
+	while (off + sizeof(struct msglog_rec) <= size) {
+		rec = (const struct msglog_rec *)(map + off);
+		reclen = sizeof(struct msglog_rec) + MSGLOG_PAD((size_t)rec->length);
+		if (rec->magic != MSGLOG_MAGIC || reclen > size - off
+			|| rec->crc != (uint32_t)crc32(0, (const Bytef *)(rec + 1), rec->length))
+		{
+			break;
+		}
+		if (rec->seq > *last_seq)
+			*last_seq = rec->seq;
+		*newest = (time_t)rec->time;
+		off += reclen;
+	}
+	return off;
+}
+
+
+static char *msglog_path(const char *dir, const char *name) {
+	size_t length = strlen(dir) + strlen(name) + 2;
+	char *path;
+	if ((path = malloc(length)))
+		snprintf(path, length, "%s/%s", dir, name);
+	return path;
+}
+
+
+static void msglog_seg_free(struct msglog_seg *seg) {
+	if (seg->map)
+		munmap(seg->map, seg->mapped);
+	free(seg->path);
+	free(seg);
+}
+
+
+void msglog_seg_retain(msglog_seg_t *seg) {
+	__atomic_add_fetch(&seg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+void msglog_seg_release(msglog_seg_t *seg) {
+	if (__atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		msglog_seg_free(seg);
+}
+
+
+// Maps an existing segment, dropping it if it holds no intact records.
+static void msglog_load(msglog_t *log, const char *name) {
+	struct msglog_seg *seg, *after;
+	struct stat st;
+	char *end;
+	int fd;
+
+	if (!(seg = calloc(1, sizeof(struct msglog_seg))))
+		return;
+	seg->first = strtoull(name, &end, 10);
+	if (end == name || !(seg->path = msglog_path(log->dir, name))) {
+		free(seg);
+		return;
+	}
+	if ((fd = open(seg->path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || st.st_size == 0
+		|| (seg->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		seg->map = NULL;
+	}
+	else {
+		seg->mapped = (size_t)st.st_size;
+		seg->size = msglog_scan(seg->map, seg->mapped, &log->last_seq, &seg->newest);
+	}
+	if (fd != -1)
+		close(fd);
+	if (seg->size == 0) {
+		unlink(seg->path);
+		msglog_seg_free(seg);
+		return;
+	}
+	// in order of their first messages
+	TAILQ_FOREACH_REVERSE(after, &log->segs, next, msglog_segs) {
+		if (after->first <= seg->first)
+			break;
+	}
+	seg->refcount = 1;
+	if (after)
+		TAILQ_INSERT_AFTER(&log->segs, after, seg, next);
+	else
+		TAILQ_INSERT_HEAD(&log->segs, seg, next);
+	log->bytes += seg->size;
+}
+
+
+msglog_t *msglog_open(const char *dir, size_t segment_size) {
+	struct dirent *de;
+	msglog_t *log;
+	size_t length;
+	DIR *d;
+
+	if (msglog_mkdirs(dir) == -1 || !(d = opendir(dir)))
+		return NULL;
+	if (!(log = calloc(1, sizeof(msglog_t))) || !(log->dir = strdup(dir))) {
+		free(log);
+		closedir(d);
+		return NULL;
+	}
+	log->segment_size = segment_size;
+	log->fd = -1;
+	pthread_mutex_init(&log->lock, NULL);
+	TAILQ_INIT(&log->segs);
+	while ((de = readdir(d))) {
+		length = strlen(de->d_name);
+		if (length > 4 && strcmp(de->d_name + length - 4, ".log") == 0)
+			msglog_load(log, de->d_name);
+	}
+	closedir(d);
+	return log;
+}
+
+
+// Writes out the buffered records, and makes them visible to replay.
+static int msglog_write(msglog_t *log) {
+	size_t off = 0;
+	ssize_t n;
+
+	if (log->buflen == 0)
+		return 0;
+	while (off < log->buflen) {
+		if ((n = write(log->fd, log->buf + off, log->buflen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			// the segment may end in part of a record now, so the next ones
+			// go to a new one
+			close(log->fd);
+			log->fd = -1;
+			log->active = NULL;
+			pthread_mutex_lock(&log->lock);
+			log->buflen = 0;
+			pthread_mutex_unlock(&log->lock);
+			return -1;
+		}
+		off += (size_t)n;
+	}
+	// the records move from the buffer to the segment at once for replay
+	pthread_mutex_lock(&log->lock);
+	__atomic_store_n(&log->active->size, log->active->size + log->buflen, __ATOMIC_RELEASE);
+	log->buflen = 0;
+	pthread_mutex_unlock(&log->lock);
+	log->active->newest = log->bufnewest;
+	log->bytes += off;
+	return 0;
+}
+
+
+// Starts a segment for records from <first> on, big enough for a record of
+// <reclen> bytes.
+static int msglog_rotate(msglog_t *log, uint64_t first, size_t reclen) {
+	struct msglog_seg *seg;
+	char name[64];
+	int fd = -1, i;
+
+	if (!(seg = calloc(1, sizeof(struct msglog_seg))))
+		return -1;
+	seg->first = first;
+	seg->mapped = reclen > log->segment_size ? reclen : log->segment_size;
+	// the name is taken if another process wrote from the same point
+	for (i = 0; i < 100 && fd == -1; i++) {
+		if (i == 0)
+			snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)first);
+		else
+			snprintf(name, sizeof(name), "%020llu-%d.log", (unsigned long long)first, i);
+		free(seg->path);
+		if (!(seg->path = msglog_path(log->dir, name)))
+			break;
+		if ((fd = open(seg->path, O_RDWR|O_CREAT|O_EXCL|O_APPEND, 0644)) == -1 && errno != EEXIST)
+			break;
+	}
+	// mapped past the end of the file, which only grows into it
+	if (fd == -1 || (seg->map = mmap(NULL, seg->mapped, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		if (fd != -1) {
+			close(fd);
+			unlink(seg->path);
+		}
+		seg->map = NULL;
+		msglog_seg_free(seg);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	seg->refcount = 1;
+	pthread_mutex_lock(&log->lock);
+	TAILQ_INSERT_TAIL(&log->segs, seg, next);
+	pthread_mutex_unlock(&log->lock);
+	if (log->fd != -1)
+		close(log->fd);
+	log->fd = fd;
+	log->active = seg;
+	return 0;
+}
+
+
+int msglog_append(msglog_t *log, uint64_t seq, const char *data, size_t length) {
+	size_t reclen = sizeof(struct msglog_rec) + MSGLOG_PAD(length), size;
+	struct msglog_rec *rec;
+	char *buf;
+
+	if (length > UINT32_MAX)
+		return -1;
+	if (!log->active || log->active->size + log->buflen + reclen > log->active->mapped) {
+		if (msglog_write(log) != 0 || msglog_rotate(log, seq, reclen) != 0)
+			return -1;
+	}
+	if (log->buflen + reclen > log->bufsize) {
+		size = log->bufsize ? log->bufsize : MSGLOG_BATCH;
+		while (size < log->buflen + reclen)
+			size *= 2;
+		pthread_mutex_lock(&log->lock);
+		buf = realloc(log->buf, size);
+		if (buf) {
+			log->buf = buf;
+			log->bufsize = size;
+		}
+		pthread_mutex_unlock(&log->lock);
+		if (!buf)
+			return -1;
+	}
+	// written past <buflen>, where replay does not look until it is raised
+	rec = (struct msglog_rec *)(log->buf + log->buflen);
+	memset(rec, 0, reclen);
+	rec->magic = MSGLOG_MAGIC;
+	rec->length = (uint32_t)length;
+	rec->seq = seq;
+	rec->time = (int64_t)time(NULL);
+	rec->crc = (uint32_t)crc32(0, (const Bytef *)data, (uInt)length);
+	memcpy(rec + 1, data, length);
+	pthread_mutex_lock(&log->lock);
+	log->buflen += reclen;
+	pthread_mutex_unlock(&log->lock);
+	log->bufnewest = (time_t)rec->time;
+	if (seq > log->last_seq)
+		log->last_seq = seq;
+	if (log->buflen >= MSGLOG_BATCH)
+		return msglog_write(log);
+	return 0;
+}
+
+
+int msglog_flush(msglog_t *log) {
+	struct msglog_seg *seg;
+	time_t now = time(NULL);
+	int status = msglog_write(log);
+
+	while ((seg = TAILQ_FIRST(&log->segs)) && seg != log->active
+		&& ((log->max_bytes && log->bytes > log->max_bytes) || (log->max_age && now - seg->newest > log->max_age)))
+	{
+		pthread_mutex_lock(&log->lock);
+		TAILQ_REMOVE(&log->segs, seg, next);
+		pthread_mutex_unlock(&log->lock);
+		log->bytes -= seg->size;
+		// unmapped once the replies referencing it are sent
+		unlink(seg->path);
+		msglog_seg_release(seg);
+	}
+	return status;
+}
+
+
+void msglog_set_retention(msglog_t *log, size_t max_bytes, int max_age) {
+	log->max_bytes = max_bytes;
+	log->max_age = max_age;
+}
+
+
+uint64_t msglog_last_seq(msglog_t *log) {
+	return log->last_seq;
+}
+
+
+// Calls <cb> for the records in <map> newer than <since>, until <*count>
+// reaches <max> or <cb> returns false. Returns false if it did.
+static bool msglog_replay_map(const char *map, size_t size, msglog_seg_t *seg, uint64_t since,
+	int max, int *count, msglog_cb_t *cb, void *arg)
+{
+	const struct msglog_rec *rec;
+	msglog_entry_t entry;
+	size_t off;
+	for (off = 0; off < size && *count < max; off += sizeof(struct msglog_rec) + MSGLOG_PAD(entry.length)) {
+		rec = (const struct msglog_rec *)(map + off);
+		entry.length = rec->length;
+		if (rec->seq <= since)
+			continue;
+		entry.seq = rec->seq;
+		entry.time = (time_t)rec->time;
+		entry.data = (const char *)(rec + 1);
+		entry.seg = seg;
+		(*count)++;
+		if (!cb(&entry, arg))
+			return false;
+	}
+	return true;
+}
+
+
+int msglog_replay(msglog_t *log, uint64_t since, int max, msglog_cb_t *cb, void *arg) {
+	struct msglog_seg *seg, *start;
+	int count = 0;
+
+	pthread_mutex_lock(&log->lock);
+	// messages newer than <since> start in the last segment starting at or before it
+	start = TAILQ_FIRST(&log->segs);
+	TAILQ_FOREACH(seg, &log->segs, next) {
+		if (seg->first > since)
+			break;
+		start = seg;
+	}
+	for (seg = start; seg && count < max; seg = TAILQ_NEXT(seg, next)) {
+		if (!msglog_replay_map(seg->map, __atomic_load_n(&seg->size, __ATOMIC_ACQUIRE), seg, since,
+			max, &count, cb, arg))
+		{
+			break;
+		}
+	}
+	// followed by the records not yet written out
+	if (!seg && count < max)
+		msglog_replay_map(log->buf, log->buflen, NULL, since, max, &count, cb, arg);
+	pthread_mutex_unlock(&log->lock);
+	return count;
+}
+
+
+void msglog_close(msglog_t *log) {
+	struct msglog_seg *seg;
+	msglog_write(log);
+	if (log->fd != -1)
+		close(log->fd);
+	while ((seg = TAILQ_FIRST(&log->segs))) {
+		TAILQ_REMOVE(&log->segs, seg, next);
+		msglog_seg_release(seg);
+	}
+	pthread_mutex_destroy(&log->lock);
+	free(log->buf);
+	free(log->dir);
+	free(log);
+}
@@ -0,0 +1,70 @@
+#ifndef _MSGLOG_H_
+#define _MSGLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Append-only message log in a directory of segment files, each named after
+// the sequence number of its first message. Messages are appended to a
+// buffer and written out in batches by msglog_flush; a segment which reaches
+// its size is sealed and a new one started. Every segment is memory-mapped,
+// so messages are replayed straight from the page cache.
+//
+// One thread appends and flushes; any thread may replay meanwhile. Replay
+// sees every message appended so far, including those still buffered.
+// Retention drops whole sealed segments, oldest first, once the log grows
+// past <max_bytes> or a segment's newest message is older than <max_age>
+// seconds.
+//
+// A log which is opened again starts a new segment rather than appending to
+// the last one, so a record cut short by a crash is left behind (and skipped
+// on replay), and a process taking over from another never writes into the
+// segment the other one is still writing.
+
+typedef struct msglog msglog_t;
+typedef struct msglog_seg msglog_seg_t;
+
+typedef struct {
+	uint64_t seq;
+	time_t time;
+	const char *data;   // in the mapping of <seg>
+	size_t length;
+	msglog_seg_t *seg;  // mapped during the callback, and after while retained;
+	                    // NULL if still buffered, when <data> is only valid
+	                    // during the callback
+} msglog_entry_t;
+
+typedef bool msglog_cb_t(const msglog_entry_t *entry, void *arg);
+
+// Opens the log in <dir>, creating the directory (and its parents) if need
+// be. Returns NULL, with errno set, if it can not be read or created.
+msglog_t *msglog_open(const char *dir, size_t segment_size);
+
+// Writes out what is buffered and closes the log.
+void msglog_close(msglog_t *log);
+
+// 0 for either leaves that limit off
+void msglog_set_retention(msglog_t *log, size_t max_bytes, int max_age);
+
+// Buffers a message; written out once enough are buffered, or by the next
+// msglog_flush. Returns -1 if it could not be written.
+int msglog_append(msglog_t *log, uint64_t seq, const char *data, size_t length);
+
+// Writes out buffered messages and drops segments past retention.
+int msglog_flush(msglog_t *log);
+
+// The highest sequence number in the log, 0 if it is empty
+uint64_t msglog_last_seq(msglog_t *log);
+
+// Keep a segment mapped, so data replayed from it can be referenced after
+// the callback; also after it was dropped, or the log closed.
+void msglog_seg_retain(msglog_seg_t *seg);
+void msglog_seg_release(msglog_seg_t *seg);
+
+// Calls <cb> for up to <max> messages newer than <since>, oldest first, until
+// it returns false. Returns the number of messages it was called for.
+int msglog_replay(msglog_t *log, uint64_t since, int max, msglog_cb_t *cb, void *arg);
+
+#endif
@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "sha1.h"
+
+// SHA-1 as described in RFC 3174. Only used for the WebSocket handshake, so
+// it favors brevity over speed.
+
+#define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+
+static void _sha1_block(sha1_t *ctx, const uint8_t *p) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+	
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3]; e = ctx->state[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5a827999; }
+		else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+		else             { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d; ctx->state[4] += e;
+}
+
+
+void sha1_init(sha1_t *ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->length = 0;
+	ctx->buffered = 0;
+}
+
+
+void sha1_update(sha1_t *ctx, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+	size_t n;
+	
+	ctx->length += len;
+	while (len) {
+		n = 64 - ctx->buffered;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buffer + ctx->buffered, p, n);
+		ctx->buffered += n;
+		p += n;
+		len -= n;
+		if (ctx->buffered == 64) {
+			_sha1_block(ctx, ctx->buffer);
+			ctx->buffered = 0;
+		}
+	}
+}
+
+
+void sha1_final(sha1_t *ctx, uint8_t digest[SHA1_DIGEST_LENGTH]) {
+	uint64_t bits = ctx->length * 8;
+	uint8_t pad[72];
+	size_t padlen = (ctx->buffered < 56 ? 56 : 120) - ctx->buffered;
+	int i;
+	
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[padlen + i] = (uint8_t)(bits >> (56 - i * 8));
+	sha1_update(ctx, pad, padlen + 8);
+	
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+		digest[i] = (uint8_t)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+
+size_t base64_encode(char *dst, const void *data, size_t len) {
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const uint8_t *p = (const uint8_t *)data;
+	char *q = dst;
+	uint32_t v;
+	
+	for (; len >= 3; p += 3, len -= 3) {
+		v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+		*q++ = chars[v >> 18];
+		*q++ = chars[(v >> 12) & 0x3f];
+		*q++ = chars[(v >> 6) & 0x3f];
+		*q++ = chars[v & 0x3f];
+	}
+	if (len) {
+		v = (uint32_t)p[0] << 16 | (len > 1 ? (uint32_t)p[1] << 8 : 0);
+		*q++ = chars[v >> 18];
+		*q++ = chars[(v >> 12) & 0x3f];
+		*q++ = len > 1 ? chars[(v >> 6) & 0x3f] : '=';
+		*q++ = '=';
+	}
+	*q = '\0';
+	return q - dst;
+}
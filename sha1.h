@@ -0,0 +1,24 @@
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LENGTH 20
+
+typedef struct {
+	uint32_t state[5];
+	uint64_t length;
+	uint8_t buffer[64];
+	size_t buffered;
+} sha1_t;
+
+void sha1_init(sha1_t *ctx);
+void sha1_update(sha1_t *ctx, const void *data, size_t len);
+void sha1_final(sha1_t *ctx, uint8_t digest[SHA1_DIGEST_LENGTH]);
+
+// Writes the base64 encoding of <len> bytes of <data> plus a terminating NUL
+// to <dst>, which must hold at least ((len + 2) / 3) * 4 + 1 bytes.
+size_t base64_encode(char *dst, const void *data, size_t len);
+
+#endif
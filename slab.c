@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+struct slab_chunk {
+	struct slab_chunk *next;
+};
+
+// object storage follows the chunk header, aligned like the objects
+#define CHUNK_HEADER_SIZE ((sizeof(struct slab_chunk) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+
+void slab_init(slab_t *slab, const char *name, size_t size, size_t per_chunk) {
+	memset(slab, 0, sizeof(slab_t));
+	slab->name = name;
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	slab->per_chunk = per_chunk > 0 ? per_chunk : 1;
+}
+
+
+void slab_destroy(slab_t *slab) {
+	struct slab_chunk *chunk, *next;
+	for (chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	slab->chunks = NULL;
+	slab->free = NULL;
+	slab->allocated = slab->inuse = 0;
+}
+
+
+// Adds a chunk and threads all of its objects onto the free list.
+static int _slab_grow(slab_t *slab) {
+	struct slab_chunk *chunk;
+	char *p;
+	size_t i;
+	
+	if (!(chunk = malloc(CHUNK_HEADER_SIZE + slab->size * slab->per_chunk)))
+		return -1;
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	p = (char *)chunk + CHUNK_HEADER_SIZE;
+	for (i = slab->per_chunk; i > 0; i--) {
+		*(void **)(p + (i - 1) * slab->size) = slab->free;
+		slab->free = p + (i - 1) * slab->size;
+	}
+	slab->allocated += slab->per_chunk;
+	return 0;
+}
+
+
+void *slab_alloc(slab_t *slab) {
+	void *obj;
+	if (!slab->free && _slab_grow(slab) == -1)
+		return NULL;
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	if (++slab->inuse > slab->highwater)
+		slab->highwater = slab->inuse;
+	return obj;
+}
+
+
+void *slab_calloc(slab_t *slab) {
+	void *obj;
+	if ((obj = slab_alloc(slab)))
+		memset(obj, 0, slab->size);
+	return obj;
+}
+
+
+void slab_free(slab_t *slab, void *obj) {
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	slab->inuse--;
+}
@@ -0,0 +1,36 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+// Fixed-size object allocator. Objects are carved out of chunks of
+// <per_chunk> objects and recycled through a free list, so allocating and
+// freeing are a couple of pointer moves and never touch malloc once the pool
+// has grown to its working size. Chunks are only returned by slab_destroy.
+// A slab is not thread safe; each event loop keeps its own.
+
+struct slab_chunk;
+
+typedef struct slab {
+	const char *name;
+	size_t size;        // object size, rounded up to pointer alignment
+	size_t per_chunk;
+	void *free;         // free list, linked through the objects themselves
+	struct slab_chunk *chunks;
+	size_t allocated;   // objects carved out of chunks
+	size_t inuse;       // objects handed out and not yet freed
+	size_t highwater;   // largest <inuse> seen
+} slab_t;
+
+void slab_init(slab_t *slab, const char *name, size_t size, size_t per_chunk);
+void slab_destroy(slab_t *slab);
+
+// Returns an uninitialized object, or NULL if a new chunk could not be allocated.
+void *slab_alloc(slab_t *slab);
+
+// Like slab_alloc but zeroes the object.
+void *slab_calloc(slab_t *slab);
+
+void slab_free(slab_t *slab, void *obj);
+
+#endif
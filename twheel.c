@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "twheel.h"
+
+#define LEVEL_INDEX(ticks, level) (((ticks) >> (TWHEEL_BITS * (level))) & (TWHEEL_SLOTS - 1))
+
+
+void twheel_init(twheel_t *wheel) {
+	int level, i;
+	for (level = 0; level < TWHEEL_LEVELS; level++) {
+		for (i = 0; i < TWHEEL_SLOTS; i++)
+			LIST_INIT(&wheel->slots[level][i]);
+	}
+	wheel->now = 0;
+	wheel->count = 0;
+}
+
+
+// Puts <timer> on the lowest level whose slots still tell its expiry apart
+// from the current tick.
+static void _twheel_place(twheel_t *wheel, twheel_timer_t *timer) {
+	uint64_t delta = timer->expires - wheel->now;
+	int level = 0;
+	while (level < TWHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (TWHEEL_BITS * (level + 1))))
+		level++;
+	LIST_INSERT_HEAD(&wheel->slots[level][LEVEL_INDEX(timer->expires, level)], timer, next);
+}
+
+
+void twheel_add(twheel_t *wheel, twheel_timer_t *timer, uint64_t ticks) {
+	if (timer->armed)
+		twheel_del(wheel, timer);
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks > TWHEEL_MAX_TICKS)
+		ticks = TWHEEL_MAX_TICKS;
+	timer->expires = wheel->now + ticks;
+	timer->armed = true;
+	_twheel_place(wheel, timer);
+	wheel->count++;
+}
+
+
+void twheel_del(twheel_t *wheel, twheel_timer_t *timer) {
+	if (!timer->armed)
+		return;
+	LIST_REMOVE(timer, next);
+	timer->armed = false;
+	wheel->count--;
+}
+
+
+// Moves the timers of the current slot on <level> down to lower levels.
+// Returns the slot index, which is 0 when the level above needs cascading too.
+static int _twheel_cascade(twheel_t *wheel, int level) {
+	int index = LEVEL_INDEX(wheel->now, level);
+	struct twheel_slot slot;
+	twheel_timer_t *timer;
+	
+	LIST_INIT(&slot);
+	if ((timer = LIST_FIRST(&wheel->slots[level][index]))) {
+		// take over the whole list
+		slot.lh_first = timer;
+		timer->next.le_prev = &slot.lh_first;
+		LIST_INIT(&wheel->slots[level][index]);
+	}
+	while ((timer = LIST_FIRST(&slot))) {
+		LIST_REMOVE(timer, next);
+		_twheel_place(wheel, timer);
+	}
+	return index;
+}
+
+
+size_t twheel_tick(twheel_t *wheel, twheel_cb_t *cb, void *arg) {
+	struct twheel_slot *slot;
+	twheel_timer_t *timer;
+	size_t expired = 0;
+	int level;
+	
+	wheel->now++;
+	if (LEVEL_INDEX(wheel->now, 0) == 0) {
+		for (level = 1; level < TWHEEL_LEVELS && _twheel_cascade(wheel, level) == 0; level++)
+			;
+	}
+	
+	slot = &wheel->slots[0][LEVEL_INDEX(wheel->now, 0)];
+	while ((timer = LIST_FIRST(slot))) {
+		LIST_REMOVE(timer, next);
+		timer->armed = false;
+		wheel->count--;
+		expired++;
+		cb(timer, arg);
+	}
+	return expired;
+}
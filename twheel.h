@@ -0,0 +1,48 @@
+#ifndef _TWHEEL_H_
+#define _TWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+// Hierarchical timer wheel. Level 0 has one slot per tick; each further level
+// has slots covering TWHEEL_SLOTS times as many ticks as the level below.
+// Arming and cancelling are O(1). Every timer in the current level 0 slot
+// expires on that tick, so it is expired in one sweep; timers on higher
+// levels are moved down a level ("cascaded") when the level below wraps.
+// Timers further ahead than the wheel spans expire at its far end.
+
+#define TWHEEL_BITS   6
+#define TWHEEL_SLOTS  (1 << TWHEEL_BITS)
+#define TWHEEL_LEVELS 4
+#define TWHEEL_MAX_TICKS (((uint64_t)1 << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1)
+
+typedef struct twheel_timer {
+	LIST_ENTRY(twheel_timer) next;
+	uint64_t expires;
+	bool armed;
+} twheel_timer_t;
+
+LIST_HEAD(twheel_slot, twheel_timer);
+
+typedef struct {
+	struct twheel_slot slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+	uint64_t now;
+	size_t count;
+} twheel_t;
+
+typedef void twheel_cb_t(twheel_timer_t *timer, void *arg);
+
+void twheel_init(twheel_t *wheel);
+
+// Arms <timer> to expire <ticks> ticks from now (at least one tick).
+void twheel_add(twheel_t *wheel, twheel_timer_t *timer, uint64_t ticks);
+void twheel_del(twheel_t *wheel, twheel_timer_t *timer);
+
+// Advances the wheel by one tick, calling <cb> for every timer which expires.
+// <cb> may free its timer, or arm or cancel any timer. Returns the number of
+// expired timers.
+size_t twheel_tick(twheel_t *wheel, twheel_cb_t *cb, void *arg);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+twheel_bench - Measures arming, cancelling and expiring long-poll timeouts
+with the hierarchical timer wheel, next to libevent's min-heap timers (what
+one event per subscriber would cost).
+
+usage: twheel_bench [timers]   (defaults to 500000)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event.h>
+
+#include "twheel.h"
+
+#ifndef TICKS_MAX
+#define TICKS_MAX 600 // 60 seconds of 100 ms ticks
+#endif
+
+static double _now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t g_expired;
+static uint64_t g_late;
+
+static void _expire_cb(twheel_timer_t *timer, void *_wheel) {
+	twheel_t *wheel = (twheel_t *)_wheel;
+	if (timer->expires != wheel->now)
+		g_late++;
+	g_expired++;
+}
+
+static void _noop_cb(int fd, short what, void *arg) {
+}
+
+static void report(const char *what, size_t n, double secs) {
+	printf("  %-28s %8.1f ns/op  %10.0f ops/s\n", what, secs * 1e9 / n, n / secs);
+}
+
+
+static void bench_twheel(size_t n, const uint64_t *ticks) {
+	twheel_timer_t *timers = calloc(n, sizeof(twheel_timer_t));
+	twheel_t *wheel = malloc(sizeof(twheel_t));
+	double t;
+	size_t i;
+	
+	printf("twheel (%zu timers, 1-%d ticks):\n", n, TICKS_MAX);
+	twheel_init(wheel);
+	
+	t = _now();
+	for (i = 0; i < n; i++)
+		twheel_add(wheel, &timers[i], ticks[i]);
+	report("arm", n, _now() - t);
+	
+	t = _now();
+	for (i = 0; i < n; i++)
+		twheel_del(wheel, &timers[i]);
+	report("cancel", n, _now() - t);
+	
+	// re-arm, as a reconnecting long-poll does
+	for (i = 0; i < n; i++)
+		twheel_add(wheel, &timers[i], ticks[i]);
+	t = _now();
+	for (i = 0; i < n; i++)
+		twheel_add(wheel, &timers[i], ticks[(i + 1) % n]);
+	report("re-arm", n, _now() - t);
+	
+	g_expired = 0;
+	g_late = 0;
+	t = _now();
+	while (wheel->count)
+		twheel_tick(wheel, _expire_cb, wheel);
+	report("expire (incl. idle ticks)", n, _now() - t);
+	if (g_expired != n || g_late)
+		printf("  ERROR: expired %zu of %zu timers, %llu on the wrong tick\n",
+			g_expired, n, (unsigned long long)g_late);
+	
+	free(wheel);
+	free(timers);
+}
+
+
+static void bench_minheap(size_t n, const uint64_t *ticks) {
+	struct event_base *base = event_base_new();
+	struct event *events = calloc(n, sizeof(struct event));
+	struct timeval tv;
+	double t;
+	size_t i;
+	
+	printf("libevent min-heap (%zu timers):\n", n);
+	
+	t = _now();
+	for (i = 0; i < n; i++) {
+		tv.tv_sec = ticks[i] / 10;
+		tv.tv_usec = (ticks[i] % 10) * 100000;
+		event_assign(&events[i], base, -1, 0, _noop_cb, NULL);
+		event_add(&events[i], &tv);
+	}
+	report("arm", n, _now() - t);
+	
+	t = _now();
+	for (i = 0; i < n; i++)
+		event_del(&events[i]);
+	report("cancel", n, _now() - t);
+	
+	for (i = 0; i < n; i++) {
+		tv.tv_sec = ticks[i] / 10;
+		tv.tv_usec = (ticks[i] % 10) * 100000;
+		event_add(&events[i], &tv);
+	}
+	t = _now();
+	for (i = 0; i < n; i++) {
+		tv.tv_sec = ticks[(i + 1) % n] / 10;
+		tv.tv_usec = (ticks[(i + 1) % n] % 10) * 100000;
+		event_add(&events[i], &tv);
+	}
+	report("re-arm", n, _now() - t);
+	
+	for (i = 0; i < n; i++)
+		event_del(&events[i]);
+	free(events);
+	event_base_free(base);
+}
+
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? (size_t)atol(argv[1]) : 500000, i;
+	uint64_t *ticks = malloc(n * sizeof(uint64_t));
+	
+	srandom(1);
+	for (i = 0; i < n; i++)
+		ticks[i] = 1 + random() % TICKS_MAX;
+	
+	bench_twheel(n, ticks);
+	bench_minheap(n, ticks);
+	
+	free(ticks);
+	return 0;
+}
@@ -77,7 +77,7 @@ yaml_node_t *yconf_find_node_in_map(yconf_t *config, yaml_node_t *map, const cha
 		yaml_node_t *key_node = config->document.nodes.start + pair->key - 1;
 		yaml_node_t *value_node = config->document.nodes.start + pair->value - 1;
 		
-		if (key_node->type == YAML_SCALAR_NODE && 
+		if (key_node->type == YAML_SCALAR_NODE && key_node->data.scalar.length == keyname_len &&
 			_strncmp((const char *)key_node->data.scalar.value, keyname, keyname_len) == 0)
 		{
 			//printf("found node %s\n", key_node->data.scalar.value);
@@ -108,8 +108,7 @@ yaml_node_t *yconf_find_node_in_coll(yconf_t *config, yaml_node_t *coll, const c
 
 yaml_node_t *yconf_find_node2(yconf_t *config, yaml_node_t *node, const char *path, bool case_sensitive) {
 	char *tokstate = NULL, *tok, pch[256];
-	memcpy(pch, path, 255);
-	pch[255] = 0;
+	snprintf(pch, sizeof(pch), "%s", path);
 	
 	for (tok = strtok_r(pch, YCONF_PATH_SEP, &tokstate); tok; tok = strtok_r(NULL, YCONF_PATH_SEP, &tokstate)) {
 		//printf("find token '%s'\n", tok);
@@ -198,12 +197,20 @@ void yconf_delete(yconf_t *config) {
 }
 
 
+// Reads the file again. If it can not be read or parsed, the configuration
+// is left as it was and -1 is returned.
 int yconf_reload(yconf_t *config) {
-	if (config->document.nodes.start)
-		yaml_document_delete(&config->document);
-	if (!yaml_parser_load(&config->parser, &config->document))
-		return false;
-	return true;
+	yconf_t fresh;
+	// stdin has been read to its end
+	if (strcmp(config->filename, "-") == 0)
+		return -1;
+	if (yconf_load(&fresh, config->filename) != 0) {
+		yconf_delete(&fresh);
+		return -1;
+	}
+	yconf_delete(config);
+	*config = fresh;
+	return 0;
 }
 
 
@@ -212,7 +219,7 @@ int yconf_load(yconf_t *config, const char *filename) {
 	int status = 0;
 	
 	// clear config
-	memset(config, 0, sizeof(config));
+	memset(config, 0, sizeof(*config));
 	
 	if (!yaml_parser_initialize(&config->parser)) {
 		fprintf(stderr, "yaml_parser_initialize error\n");
@@ -223,8 +230,10 @@ int yconf_load(yconf_t *config, const char *filename) {
 	
 	if (strcmp(config->filename, "-") == 0)
 		file = stdin;
-	else
-		assert((file = fopen(config->filename, "rb")));
+	else if (!(file = fopen(config->filename, "rb"))) {
+		fprintf(stderr, "failed to open %s\n", config->filename);
+		return -3;
+	}
 	
 	yaml_parser_set_input_file(&config->parser, file);
 	
@@ -234,7 +243,7 @@ int yconf_load(yconf_t *config, const char *filename) {
 	}
 	
 	if (file != stdin)
-		assert(!fclose(file));
+		fclose(file);
 	
 	return status;
 }